@@ -0,0 +1,32 @@
+#ifndef __TF_HOST_H
+#define __TF_HOST_H
+#include "thinfat32.h"
+
+// Host block device: a FAT32 image file opened once and accessed with pread()/pwrite()
+// on a persistent descriptor.  Used by the test fixture and for manipulating images on a PC.
+typedef struct struct_TFHostDevice {
+    TFBlockDevice dev;
+    int fd;
+} TFHostDevice;
+
+int tf_host_open(TFHostDevice *host, const char *path);
+int tf_host_close(TFHostDevice *host);
+
+// Memory mapped host block device: the whole image is mmap()ed, tf_fetch() works directly on
+// the mapping and the sectors written since the last flush are msync()ed as a handful of ranges.
+#define TF_MMAP_DIRTY_RANGES 8
+
+typedef struct struct_TFMmapDevice {
+    TFBlockDevice dev;
+    int fd;
+    uint8_t *base;
+    uint32_t sectors;
+    int dirtyRanges;
+    uint32_t dirtyFirst[TF_MMAP_DIRTY_RANGES];     // first sector of each dirty range
+    uint32_t dirtyLast[TF_MMAP_DIRTY_RANGES];      // last sector of each dirty range
+} TFMmapDevice;
+
+int tf_mmap_open(TFMmapDevice *image, const char *path);
+int tf_mmap_close(TFMmapDevice *image);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef __TF_URING_H
+#define __TF_URING_H
+#include "thinfat32.h"
+
+// io_uring host block device (Linux only, define TF_NO_IO_URING to leave it out).
+// Batches handed to TFBlockDevice.submit are kept in flight up to TF_URING_DEPTH operations at
+// a time; single transfers just use pread()/pwrite() on the same descriptor.
+#if defined(__linux__) && !defined(TF_NO_IO_URING)
+#define TF_HAVE_IO_URING
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define TF_URING_DEPTH 32
+#define TF_URING_IOV 32         // iovecs per ring operation, longer requests are split
+
+typedef struct struct_TFUringDevice {
+    TFBlockDevice dev;
+    int fd;
+    int ring;
+    // submission queue, shared with the kernel
+    uint32_t *sqHead;
+    uint32_t *sqTail;
+    uint32_t *sqMask;
+    uint32_t *sqArray;
+    struct io_uring_sqe *sqes;
+    // completion queue, shared with the kernel
+    uint32_t *cqHead;
+    uint32_t *cqTail;
+    uint32_t *cqMask;
+    struct io_uring_cqe *cqes;
+    void *sqRing;
+    void *cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    size_t sqesSize;
+    // one slot per operation in flight
+    struct iovec iov[TF_URING_DEPTH][TF_URING_IOV];
+    uint32_t expected[TF_URING_DEPTH];
+    int freeSlot[TF_URING_DEPTH];
+    int freeSlots;
+} TFUringDevice;
+
+int tf_uring_open(TFUringDevice *uring, const char *path);
+int tf_uring_close(TFUringDevice *uring);
+#endif
+
+#endif
@@ -7,11 +7,57 @@
 
 #define TF_MAX_PATH 256
 #define TF_FILE_HANDLES 5
+#define TF_FILE_EXTENTS 8       // runs of contiguous clusters each file handle remembers, for seeking
+#define TF_ZERO_RUN 32          // sectors per device call when zeroing (tf_zero_sectors)
+#define TF_BATCH 16             // requests handed to the device at once (see TFBlockDevice.submit)
+#define TF_FREE_BATCH 128       // clusters gathered per pass when freeing a cluster chain
+#define TF_FREE_RUN_SCAN 64     // FAT sectors searched for a run of free clusters, on volumes too big for the bitmap
+#define TF_FAT_SCAN_RUN 8       // FAT sectors read per device call when searching for free clusters
+#ifndef TF_FREEMAP_CLUSTERS
+#define TF_FREEMAP_CLUSTERS 1048576 // clusters the free cluster bitmap can track (128KB, a multiple of 1024, 0 for no bitmap); bigger volumes scan the FAT instead
+#endif
+#ifndef TF_MOUNT_THREADS
+#define TF_MOUNT_THREADS 0      // extra threads reading the FAT into the free cluster bitmap (needs pthreads, and TFBlockDevice.read safe to call from several threads)
+#endif
+#define TF_MOUNT_SCAN_RUN 64    // FAT sectors each mount thread reads per device call (a multiple of 8)
+#ifndef TF_CACHE_SETS
+#define TF_CACHE_SETS 8         // sector cache: number of sets (must be a power of two)
+#endif
+#ifndef TF_CACHE_WAYS
+#define TF_CACHE_WAYS 4         // sector cache: sectors held per set
+#endif
+#ifndef TF_CACHE_DIRTY_LIMIT
+#define TF_CACHE_DIRTY_LIMIT 24 // sector cache: dirty sectors allowed to build up before they are all written back
+#endif
+#define TF_CACHE_FLUSH_IOV 64   // segments handed to the device per batch when writing back a cache
+#define TF_READAHEAD_MIN 4      // sectors read ahead once a file is being read sequentially
+#define TF_READAHEAD_MAX 16     // ... doubling on every read ahead up to this many
+#define TF_DELAY_CLUSTERS 16    // clusters a file opened with "d" can append before they have to be allocated
+#ifndef TF_FAT_CACHE_SETS
+#define TF_FAT_CACHE_SETS 16    // FAT cache: number of sets (must be a power of two)
+#endif
+#ifndef TF_FAT_CACHE_WAYS
+#define TF_FAT_CACHE_WAYS 1     // FAT cache: sectors held per set
+#endif
+#define TF_DENTRY_SETS 16       // directory entry cache: number of sets (must be a power of two)
+#define TF_DENTRY_WAYS 2        // directory entry cache: entries held per set
+#define TF_DENTRY_NAME 32       // directory entry cache: longest name it remembers
+#ifndef TF_DIR_INDEXES
+#define TF_DIR_INDEXES 2        // directories that can have a name index at once
+#endif
+#ifndef TF_DIR_INDEX_SLOTS
+#define TF_DIR_INDEX_SLOTS 256  // name index: slots per directory (must be a power of two), two per entry, 3/4 of them usable; 1KB each
+#endif
+#define TF_DIR_FREE_RUNS 8      // name index: runs of deleted records remembered per directory, for new entries to reuse
+#define TF_LFN_ENTRIES 20       // most LFN records a long name can take (255 characters)
+#define TF_CACHE_EMPTY 0xffffffff   // sector number of a cache entry that holds nothing
+#define TF_FREE_UNKNOWN 0xffffffff  // tf_info.freeCount when the number of free clusters isn't known
 
 #define TF_FLAG_DIRTY 0x01
 #define TF_FLAG_OPEN 0x02
 #define TF_FLAG_SIZECHANGED 0x04
 #define TF_FLAG_ROOT 0x08
+#define TF_FLAG_RESERVED 0x10   // tf_fallocate() may have chained clusters past the end of the file
 
 #define TYPE_FAT12 0
 #define TYPE_FAT16 1
@@ -61,6 +107,114 @@ typedef struct struct_TFStats {
 #endif
 
     
+// One segment of a vectored transfer: count sectors (count*512 bytes) at data
+typedef struct struct_TFIOVec {
+    uint8_t *data;
+    uint32_t count;
+} TFIOVec;
+
+// One request of a batch: the segments of iov are transferred to (write != 0) or from
+// consecutive sectors starting at sector
+typedef struct struct_TFBlockRequest {
+    const TFIOVec *iov;
+    int iovcnt;
+    uint32_t sector;
+    uint8_t write;
+} TFBlockRequest;
+
+// Block device interface
+// Every sector thinfat32 reads or writes goes through one of these.  Fill in the callbacks
+// for your media (ctx is handed back to them untouched) and pass the struct to tf_init().
+// read/write transfer count consecutive 512 byte sectors starting at sector, and return 0
+// for NO ERROR, nonzero otherwise.
+// readv/writev are optional (may be NULL): they transfer the segments of iov, in order, to or
+// from consecutive sectors starting at sector.  Without them the segments are done one read()
+// or write() at a time.
+// flush is optional (may be NULL) and is called when a file is flushed, so that anything the
+// device buffers internally reaches the media.
+// submit is optional (may be NULL).  It starts every request of a batch, in any order and as
+// many at a time as the device likes, and returns once all of them have completed (0 if all
+// succeeded).  Without it the requests are done one after the other with readv()/writev().
+// map is optional (may be NULL).  Devices that keep the media in memory return a pointer to
+// the given sector, which tf_fetch() then uses in place of tf_info's own sector buffer.  The
+// core modifies the sector in place and still calls write() with that same pointer when it is
+// done, so the device knows what to commit on flush.  Return NULL for sectors that can't be mapped.
+typedef struct struct_TFBlockDevice {
+    int (*read)(void *ctx, uint8_t *data, uint32_t sector, uint32_t count);
+    int (*write)(void *ctx, uint8_t *data, uint32_t sector, uint32_t count);
+    int (*readv)(void *ctx, const TFIOVec *iov, int iovcnt, uint32_t sector);
+    int (*writev)(void *ctx, const TFIOVec *iov, int iovcnt, uint32_t sector);
+    int (*flush)(void *ctx);
+    int (*submit)(void *ctx, const TFBlockRequest *reqs, int count);
+    uint8_t *(*map)(void *ctx, uint32_t sector);
+    void *ctx;
+} TFBlockDevice;
+
+// One sector held by a TFCache
+typedef struct struct_TFCacheEntry {
+    uint32_t sector;            // TF_CACHE_EMPTY if the entry is unused
+    uint32_t lastUse;           // cache clock at the last access, for LRU replacement
+    uint8_t flags;              // TF_FLAG_DIRTY if data has to be written back before it is reused
+    uint8_t *data;
+} TFCacheEntry;
+
+// Set-associative, write-back sector cache
+// A sector can only live in set (sector & (sets-1)), in any of that set's ways; when they
+// are all taken the least recently used one is reused.  Dirty sectors are not written one at
+// a time: when one has to be evicted, or dirtyLimit of them have built up, every dirty sector
+// of the cache is written back at once, in LBA order, with neighbouring sectors merged into
+// one request.  The entries and their data are storage the owner hands to tf_cache_init().
+typedef struct struct_TFCache {
+    uint32_t sets;
+    uint32_t ways;
+    uint32_t clock;
+    uint32_t dirtyLimit;        // write back everything once this many entries are dirty
+    uint32_t hits;
+    uint32_t misses;
+    TFCacheEntry *entries;      // sets*ways entries, one set after the other
+} TFCache;
+
+// A directory entry found while walking a path, remembered in the directory entry cache
+// (see tf_dentry_lookup()) under the directory it is in and the name it was looked up by, so
+// that opening the same path again doesn't have to search the directories along it
+typedef struct struct_TFDentry {
+    uint32_t dirCluster;        // first cluster of the directory holding the entry, 0 if unused
+    uint32_t entryPos;          // offset of the entry's 8.3 record in that directory
+    uint32_t entrySector;       // the sector holding that record
+    uint32_t startCluster;
+    uint32_t size;
+    uint32_t lastUse;           // tf_info.dentryClock at the last lookup, for LRU replacement
+    uint8_t attributes;
+    uint8_t nameLength;
+    uint8_t name[TF_DENTRY_NAME];   // compared without regard to case, like the directory search
+} TFDentry;
+
+// Hashed index of the names in a directory (see tf_dir_index_find()).  Every entry has a slot
+// for its long name, if it has one, and one for its 8.3 name, each holding a tag from the
+// name's hash and the number of the entry's first record (the start of its LFN chain).
+// Probing is linear, the tag weeds out most collisions and the directory itself settles the
+// rest.  An index that filled up past 3/4 stops taking names and is no longer complete.
+// Deleted records (see tf_remove()) are remembered in runs, up to TF_DIR_FREE_RUNS of them, so
+// that tf_create() and tf_mkdir() can put new entries there rather than at the end.  The
+// longest run left out for want of room is noted, and the index is rebuilt to find it again.
+#define TF_DIR_INDEX_EMPTY 0xffffffff
+#define TF_DIR_INDEX_DELETED 0xfffffffe    // a slot whose entry was removed, probing goes on past it
+typedef struct struct_TFDirRun {
+    uint16_t record;
+    uint16_t count;             // 0 if the run is unused
+} TFDirRun;
+
+typedef struct struct_TFDirIndex {
+    uint32_t dirCluster;        // first cluster of the directory, 0 if unused
+    uint32_t lastUse;           // tf_info.dirIndexClock at the last lookup, for LRU replacement
+    uint32_t count;             // slots in use
+    uint8_t complete;           // every name in the directory is in slots
+    uint32_t end;               // record number of the directory's terminating (zero) record
+    TFDirRun freeRuns[TF_DIR_FREE_RUNS];    // runs of deleted records
+    uint16_t lostRun;           // length of the longest run not in freeRuns, 0 if none
+    uint32_t slots[TF_DIR_INDEX_SLOTS];     // (tag << 16) | record, TF_DIR_INDEX_EMPTY or TF_DIR_INDEX_DELETED
+} TFDirIndex;
+
 // Ultimately, once the filesystem is checked for consistency, you only need a few
 // things to keep it up and running.  These are:
 // 1) The type (fat16 or fat32, no fat12 support)
@@ -76,18 +230,45 @@ typedef struct struct_tfinfo {
     uint8_t sectorsPerCluster;
     uint32_t firstDataSector;
     uint32_t totalSectors;
+    uint32_t totalClusters;     // one past the highest cluster number of the volume
     uint16_t reservedSectors;
+    uint16_t fsinfoSector;      // 0 if the volume has no (valid) FSInfo sector
+    uint32_t fatSize;           // sectors per FAT
+    uint32_t fatStart;          // first sector of the FAT that is read (the active one, or the first)
+    uint8_t fatCopies;          // FATs each FAT sector is written to, starting with the one at fatStart
+    TFBlockDevice *dev;
     // "LIVE" DATA
     uint32_t currentSector;
-    uint8_t sectorFlags;
-    uint32_t rootDirectorySize;
-    uint8_t buffer[512];
+    uint8_t freemapReady;       // tf_freemap holds the state of every cluster, see tf_freemap_build()
+    uint8_t freemapPending;     // tf_freemap hasn't been built since the volume was mounted, see tf_freemap_ready()
+    uint32_t freeCount;         // free clusters on the volume, or TF_FREE_UNKNOWN
+    uint32_t nextFree;          // where the search for a free cluster starts
+    uint8_t fsinfoDirty;        // freeCount or nextFree changed since the FSInfo sector was written
+    uint8_t *buffer;            // the current sector: current->data
+    TFCacheEntry *current;      // the entry holding the current sector, flag it dirty after modifying buffer
+    TFCache cache;              // recently used sectors
+    TFCache fatCache;           // recently used sectors of the FAT, only touched through tf_get/set_fat_entry()
+    TFCacheEntry mapped;        // the current sector, when it comes straight from the device's memory (see map)
+    uint32_t delayBase;         // first placeholder cluster number for delayed allocation, 0 if it isn't possible
+    uint32_t delayedClusters;   // placeholder clusters handed out and not allocated yet, over all files
+    uint32_t dentryClock;       // directory entry cache lookups so far
+    uint32_t dirIndexClock;     // directory name index lookups so far
 } TFInfo;
 
 /////////////////////////////////////////////////////////////////////////////////
 
+// A run of contiguous clusters of a file: clusters index..index+count-1 of the file are
+// clusters cluster..cluster+count-1 of the volume
+typedef struct struct_TFExtent {
+    uint32_t index;
+    uint32_t cluster;
+    uint32_t count;
+} TFExtent;
+
 typedef struct struct_TFFILE {
     uint32_t parentStartCluster;
+    uint32_t direntPos;         // offset of the file's 8.3 record in the parent directory
+    uint32_t direntSector;      // the sector holding that record, 0 if it has to be looked up again (and for "/")
     uint32_t startCluster;
     uint32_t currentClusterIdx;
     uint32_t currentCluster;
@@ -98,6 +279,14 @@ typedef struct struct_TFFILE {
     uint8_t attributes;
     uint8_t mode;
     uint32_t size;
+    uint32_t raPos;             // where the last tf_fread() stopped, a read starting anywhere else isn't sequential
+    uint32_t raLimit;           // first sector (counted from the start of the file) not read ahead yet
+    uint16_t raWindow;          // sectors to read ahead next time, 0 until the reads turn out to be sequential
+    TFExtent extents[TF_FILE_EXTENTS];  // the start of the cluster chain, as far as it has been walked
+    uint8_t extentCount;
+    uint32_t delayIdx;          // cluster index (in the file) of the first cluster whose allocation is delayed
+    uint32_t delayTail;         // the last cluster of the file that is allocated, while delayCount isn't 0
+    uint16_t delayCount;        // clusters at the end of the file that only have placeholders so far
     uint8_t filename[TF_MAX_PATH];
 } TFFile;
 
@@ -106,6 +295,7 @@ typedef struct struct_TFFILE {
 #define TF_MODE_WRITE 0x02
 #define TF_MODE_APPEND 0x04
 #define TF_MODE_OVERWRITE 0x08
+#define TF_MODE_DELAYED 0x10
 
 #define TF_ATTR_READ_ONLY 0x01
 #define TF_ATTR_HIDDEN 0x02
@@ -119,10 +309,19 @@ typedef struct struct_TFFILE {
 
 int read_sector(uint8_t *data, uint32_t blocknum);
 int write_sector(uint8_t *data, uint32_t blocknum);
+int read_sectors(uint8_t *data, uint32_t blocknum, uint32_t count);
+int write_sectors(uint8_t *data, uint32_t blocknum, uint32_t count);
+int read_sectorsv(const TFIOVec *iov, int iovcnt, uint32_t blocknum);
+int write_sectorsv(const TFIOVec *iov, int iovcnt, uint32_t blocknum);
+int transfer_sectors(const TFBlockRequest *reqs, int count);
+int flush_device(void);
 // New error codes
 #define TF_ERR_NO_ERROR 0
 #define TF_ERR_BAD_BOOT_SIGNATURE 1
 #define TF_ERR_BAD_FS_TYPE 2
+#define TF_ERR_NO_DEVICE 3
+#define TF_ERR_IO 4
+#define TF_ERR_NO_SPACE 5
 
 #define TF_ERR_INVALID_SEEK 1
 
@@ -131,9 +330,22 @@ int write_sector(uint8_t *data, uint32_t blocknum);
 #define TF_TYPE_FAT32 1
 
 // New backend functions
-int tf_init(void);
+int tf_init(TFBlockDevice *dev);
 int tf_fetch(uint32_t sector);
+int tf_fetch_blank(uint32_t sector);
 int tf_store(void);
+void tf_cache_init(TFCache *cache, TFCacheEntry *entries, uint8_t *data, uint32_t sets, uint32_t ways);
+TFCacheEntry *tf_cache_lookup(TFCache *cache, uint32_t sector);
+int tf_cache_claim(TFCache *cache, TFCacheEntry *entry, uint32_t sector);
+int tf_cache_fetch(TFCache *cache, uint32_t sector, TFCacheEntry **entry);
+int tf_cache_prefetch(TFCache *cache, uint32_t sector, uint32_t count);
+int tf_cache_store(TFCacheEntry *entry);
+int tf_cache_submit(TFCache *cache, TFBlockRequest *batch, int count);
+int tf_cache_flush(TFCache *cache);
+void tf_cache_overlay(TFCache *cache, uint8_t *dest, uint32_t sector, uint32_t count);
+void tf_cache_update(TFCache *cache, uint8_t *src, uint32_t sector, uint32_t count);
+int tf_fetch_run(uint8_t *dest, uint32_t sector, uint32_t count);
+int tf_store_run(uint8_t *src, uint32_t sector, uint32_t count);
 uint32_t tf_get_fat_entry(uint32_t cluster);
 int tf_set_fat_entry(uint32_t cluster, uint32_t value);
 int tf_unsafe_fseek(TFFile *fp, int32_t base, long offset);
@@ -145,25 +357,79 @@ TFFile *tf_parent(uint8_t *filename, const uint8_t *mode, int mkParents);
 int tf_shorten_filename(uint8_t *dest, uint8_t *src, uint8_t num);
 
 // New frontend functions
-int tf_init();
+int tf_init(TFBlockDevice *dev);
 int tf_fflush(TFFile *fp);
+int tf_sync(void);
+int tf_unmount(void);
+uint32_t tf_free_clusters(void);
 int tf_fseek(TFFile *fp, int32_t base, long offset);
+void tf_readahead(TFFile *fp);
+void tf_extent_reset(TFFile *fp);
+uint32_t tf_extent_lookup(TFFile *fp, uint32_t index);
+void tf_extent_append(TFFile *fp, uint32_t index, uint32_t cluster);
 int tf_fclose(TFFile *fp);
 int tf_fread(uint8_t *dest,  int size,  TFFile *fp);
 int tf_find_file(TFFile *current_directory, uint8_t *name);
 int tf_compare_filename(TFFile *fp, uint8_t *name);
 uint32_t tf_first_sector(uint32_t cluster);
 uint8_t *tf_walk(uint8_t *filename, TFFile *fp);
+uint32_t tf_dentry_hash(uint32_t dir, uint8_t *name, int length);
+TFDentry *tf_dentry_lookup(uint32_t dir, uint8_t *name, int length);
+void tf_dentry_insert(uint32_t dir, uint8_t *name, int length, TFFile *fp);
+void tf_dentry_update(uint32_t dir, uint32_t pos, uint32_t size);
+void tf_dentry_invalidate(uint32_t dir);
+void tf_dentry_forget(uint32_t dir, uint32_t pos);
+TFDirIndex *tf_dir_index_get(uint32_t dir);
+void tf_dir_index_insert(TFDirIndex *index, uint8_t *name, int length, uint32_t record);
+void tf_dir_index_add(uint32_t dir, uint8_t *lfn, uint8_t *sfn, uint32_t record, uint32_t end);
+void tf_dir_index_drop(uint32_t dir);
+void tf_dir_index_remove(TFDirIndex *index, uint8_t *name, int length, uint32_t record);
+void tf_dir_index_free(TFDirIndex *index, uint32_t record, uint32_t count);
+int tf_dir_seek_free(TFFile *dir, uint32_t count);
+int tf_dir_index_find(TFFile *dir, uint8_t *name);
+int tf_dir_index_build(TFFile *dir, uint8_t *name, int length);
+int tf_sfn_name(uint8_t *dest, uint8_t *sfn);
 TFFile *tf_fopen(uint8_t *filename, const uint8_t *mode);
 int tf_fwrite(uint8_t *src, int size, int count, TFFile *fp);
+int tf_fallocate(TFFile *fp, uint32_t bytes);
+int tf_fallocate_release(TFFile *fp);
+int tf_delay_commit(TFFile *fp);
+int tf_delay_commit_all(void);
 int tf_fputs(uint8_t *src, TFFile *fp);
 int tf_mkdir(uint8_t *filename, int mkParents);
 int tf_remove(uint8_t *filename);
 void tf_print_open_handles(void);
 
+uint32_t tf_scan_free_cluster(uint32_t start, uint32_t end);
 uint32_t tf_find_free_cluster();
 uint32_t tf_find_free_cluster_from(uint32_t c);
-
+uint32_t tf_scan_free_run(uint32_t start, uint32_t end, uint32_t length);
+uint32_t tf_lowest_bit(uint32_t word);
+uint32_t tf_popcount(uint32_t word);
+uint32_t tf_fat_free_mask(const uint32_t *entries);
+uint32_t tf_fat_find_free(const uint32_t *entries, uint32_t count);
+uint32_t tf_fat_count_free(const uint32_t *entries, uint32_t count);
+uint32_t tf_fat_find_run(const uint32_t *entries, uint32_t count, uint32_t length, uint32_t *run);
+int tf_fsinfo_load(void);
+int tf_fsinfo_store(void);
+uint32_t tf_freemap_fill(const uint32_t *entries, uint32_t sector, uint32_t count);
+int tf_freemap_ready(void);
+#if TF_MOUNT_THREADS > 0
+void *tf_freemap_scan(void *arg);
+#endif
+int tf_freemap_build(void);
+void tf_freemap_set(uint32_t cluster, int used);
+uint32_t tf_freemap_find(uint32_t start);
+uint32_t tf_freemap_find_used(uint32_t start);
+uint32_t tf_freemap_best_fit(uint32_t count, uint32_t *length);
+uint32_t tf_allocate_run(uint32_t tail, uint32_t count, uint32_t *length);
+int tf_delay_virtual(uint32_t cluster);
+int tf_delay_sector(uint32_t sector);
+uint32_t tf_delay_cluster(TFFile *fp);
+int tf_delay_move(uint32_t from, uint32_t to, uint32_t count);
+int tf_delay_evict(TFCacheEntry *entry);
+
+int tf_zero_sectors(uint32_t sector, uint32_t count);
 uint32_t tf_initializeMedia(uint32_t totalSectors);
 uint32_t tf_initializeMediaNoBlock(uint32_t totalSectors, int start);
 
@@ -54,6 +54,17 @@ typedef struct struct_BPB_struct {
     } FSTypeSpecificData;
 } BPB_struct;
 
+// The FAT32 FSInfo sector, found at BPB32_struct.FSInfo
+typedef struct struct_FSInfo_struct {
+    uint32_t    LeadSig;               // 4    0x41615252
+    uint8_t     Reserved1[480];        // 480
+    uint32_t    StrucSig;              // 4    0x61417272
+    uint32_t    FreeCount;             // 4    0xffffffff if unknown
+    uint32_t    NextFree;              // 4    0xffffffff if unknown
+    uint8_t     Reserved2[12];         // 12
+    uint32_t    TrailSig;              // 4    0xaa550000
+} FSInfo_struct;
+
 typedef struct struct_FatFile83 {
     uint8_t filename[8];
     uint8_t extension[3];
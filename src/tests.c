@@ -3,26 +3,85 @@
 #include <stdlib.h>
 #include <string.h>
 #include "fat32_ui.h"
+#include "tf_host.h"
+#include "tf_uring.h"
 
 #define NO_ERROR 0
 #define FILE_OPEN_ERROR -1
 #define DATA_READ_ERROR -2
 #define DATA_WRITE_ERROR -3
 #define DATA_MISMATCH_ERROR -4
+#define TEST_BATCH 100          // requests in the batch test, more than the io_uring backend has slots for
 
 // Tests
 int basic_read(char *input_fle, char *expected);
 int basic_write(char *input_file, char *write_string);
 int basic_append(char *input_file, char *write_string);
+int test_mmap_dirty(TFMmapDevice *image);
+int test_batch(void);
+int test_pattern_write(char *input_file, char *mode, uint32_t size, int seed);
+int test_pattern_read(char *input_file, uint32_t size, int seed);
+int test_basic_unaligned_read(char *input_file, uint32_t size);
+int test_read_sector(uint32_t sector, uint8_t *data);
+int test_basic_fsinfo(void);
+int test_basic_seek(char *input_file, char *other_file);
+int test_basic_fallocate(char *input_file, uint32_t size);
+int test_basic_delayed(char *input_file, uint32_t size);
+int test_basic_remove_chain(char *input_file, uint32_t clusters);
+int test_basic_fat_mirror(void);
+int test_fat_kernels(void);
+int test_basic_dentry(char *dir);
+int test_basic_index(char *dir, int count);
+int test_basic_fclose_size(char *input_file, char *write_string);
+int test_basic_reuse(char *dir);
 
 int main(int argc, char **argv) {
     TFFile *fp;
+    TFHostDevice host;
+    TFMmapDevice mapped;
+#ifdef TF_HAVE_IO_URING
+    TFUringDevice uring;
+#endif
+    TFBlockDevice *dev;
     char data;
-    int rc;
+    int rc, i;
+    char *image = "test.fat32", *backend = "host";
+
+    // tests [-host|-mmap|-uring] [image]
+    for(i=1; i<argc; i++) {
+        if(argv[i][0] == '-') backend = argv[i] + 1;
+        else image = argv[i];
+    }
 
     printf("\r\nFAT32 Filesystem Test");
     printf("\r\n-----------------------");
-    tf_init();
+    if(!strcmp(backend, "host")) {
+        rc = tf_host_open(&host, image);
+        dev = &host.dev;
+    }
+    else if(!strcmp(backend, "mmap")) {
+        rc = tf_mmap_open(&mapped, image);
+        dev = &mapped.dev;
+    }
+#ifdef TF_HAVE_IO_URING
+    else if(!strcmp(backend, "uring")) {
+        rc = tf_uring_open(&uring, image);
+        dev = &uring.dev;
+    }
+#endif
+    else {
+        printf("\r\nUnknown block device '%s'\r\n", backend);
+        return 1;
+    }
+    if(rc) {
+        printf("\r\nCould not open image '%s' (%s)\r\n", image, backend);
+        return 1;
+    }
+    printf("\r\nImage '%s' on the %s block device", image, backend);
+    if(rc = tf_init(dev)) {
+        printf("\r\ntf_init() failed with error code 0x%x\r\n", rc);
+        return 1;
+    }
 
     // BASIC WRITE, Root directory, LFN
     printf("\r\n[TEST] Basic LFN write test ") ;
@@ -44,7 +103,85 @@ int main(int argc, char **argv) {
     if(rc = test_basic_read("/test0.txt", "Hello, World!")) {
         printf("\r\n[TEST] Basic 8.3 read test failed with error code 0x%x", rc) ;
     }else { printf("\r\n[TEST] Basic 8.3 read test PASSED."); }
+
+    // DIRTY RANGES of a mapped image, more sectors apart than there are ranges
+    if(dev == &mapped.dev) {
+        if(rc = test_mmap_dirty(&mapped)) {
+            printf("\r\n[TEST] Mapped image dirty range test failed with error code 0x%x", rc) ;
+        }else { printf("\r\n[TEST] Mapped image dirty range test PASSED."); }
+    }
+
+    // BATCHED TRANSFERS, longer than any device queue
+    if(rc = test_batch()) {
+        printf("\r\n[TEST] Batch transfer test failed with error code 0x%x", rc) ;
+    }else { printf("\r\n[TEST] Batch transfer test PASSED."); }
+
+    // UNALIGNED READS over several clusters, at random and from start to end
+    if(rc = test_basic_unaligned_read("/test_unaligned.bin", 20000)) {
+        printf("\r\n[TEST] Unaligned read test failed with error code 0x%x", rc) ;
+    }else { printf("\r\n[TEST] Unaligned read test PASSED."); }
+
+    // SEEKING in a fragmented file, past what the extent map holds
+    if(rc = test_basic_seek("/test_seek.bin", "/test_seek_gaps.bin")) {
+        printf("\r\n[TEST] Fragmented seek test failed with error code 0x%x", rc) ;
+    }else { printf("\r\n[TEST] Fragmented seek test PASSED."); }
+
+    // PREALLOCATE, then write into the reserved clusters or leave them to be given back on close
+    if(rc = test_basic_fallocate("/test_fallocate.bin", 20000)) {
+        printf("\r\n[TEST] Preallocation test failed with error code 0x%x", rc) ;
+    }else { printf("\r\n[TEST] Preallocation test PASSED."); }
+
+    // DELAYED ALLOCATION, the clusters being allocated on close, then read after mounting again
+    if(rc = test_basic_delayed("/test_delayed.bin", 50000)) {
+        printf("\r\n[TEST] Delayed allocation test failed with error code 0x%x", rc) ;
+    }else { printf("\r\n[TEST] Delayed allocation test PASSED."); }
+
+    // REMOVE a file with a chain longer than a batch of freed clusters
+    if(rc = test_basic_remove_chain("/test_remove_chain.bin", TF_FREE_BATCH + 72)) {
+        printf("\r\n[TEST] Long chain remove test failed with error code 0x%x", rc) ;
+    }else { printf("\r\n[TEST] Long chain remove test PASSED."); }
+
+    // FAT SCAN KERNELS against plain loops over the entries
+    if(rc = test_fat_kernels()) {
+        printf("\r\n[TEST] FAT scan kernel test failed with error code 0x%x", rc) ;
+    }else { printf("\r\n[TEST] FAT scan kernel test PASSED."); }
+
+    // DIRECTORY ENTRY CACHE, across removing a file and creating it again
+    if(rc = test_basic_dentry("/dentry")) {
+        printf("\r\n[TEST] Directory entry cache test failed with error code 0x%x", rc) ;
+    }else { printf("\r\n[TEST] Directory entry cache test PASSED."); }
+
+    // DIRECTORY NAME INDEX, across removing a file and creating it again (in a directory that
+    // fits the index, each entry taking two slots of the 3/4 that can be used)
+    if(rc = test_basic_index("/index", (TF_DIR_INDEX_SLOTS/8 < 40) ? TF_DIR_INDEX_SLOTS/8 : 40)) {
+        printf("\r\n[TEST] Directory name index test failed with error code 0x%x", rc) ;
+    }else { printf("\r\n[TEST] Directory name index test PASSED."); }
+
+    // FILE SIZE ON DISK once tf_fclose() returns, without unmounting
+    if(rc = test_basic_fclose_size("/test_fclose_size.txt", "Hello, World")) {
+        printf("\r\n[TEST] Size after fclose test failed with error code 0x%x", rc) ;
+    }else { printf("\r\n[TEST] Size after fclose test PASSED."); }
+
+    // REMOVE then CREATE, the new entry going over the deleted records, with and without a name index
+    if(rc = test_basic_reuse("/reuse")) {
+        printf("\r\n[TEST] Entry reuse test failed with error code 0x%x", rc) ;
+    }else { printf("\r\n[TEST] Entry reuse test PASSED."); }
+
+    // FSINFO on disk after unmounting, against the FAT, once all the tests above have written
+    if(rc = test_basic_fsinfo()) {
+        printf("\r\n[TEST] FSInfo test failed with error code 0x%x", rc) ;
+    }else { printf("\r\n[TEST] FSInfo test PASSED."); }
+    // FAT COPIES on disk after unmounting
+    if(rc = test_basic_fat_mirror()) {
+        printf("\r\n[TEST] FAT mirror test failed with error code 0x%x", rc) ;
+    }else { printf("\r\n[TEST] FAT mirror test PASSED."); }
     
+    tf_unmount();
+    if(dev == &mapped.dev) tf_mmap_close(&mapped);
+#ifdef TF_HAVE_IO_URING
+    else if(dev == &uring.dev) tf_uring_close(&uring);
+#endif
+    else tf_host_close(&host);
     return 0;
 }
 
@@ -135,3 +272,665 @@ int test_basic_append(char *input_file, char *write_string) {
         return FILE_OPEN_ERROR;
     }
 }
+
+/*
+ * Rewrite sectors of a mapped image with what they already hold, twice as many as the device
+ * keeps dirty ranges for and far enough apart that none of them touch, after checking that
+ * tf_fetch() works on the mapping itself.  Return 0 if the sectors fetched are the mapped ones,
+ * the dirty ranges are all in use and between them cover every sector written, and flushing
+ * the device empties them.
+ * Return an appropriate error code if there's any problem.
+ */
+int test_mmap_dirty(TFMmapDevice *image) {
+    uint8_t data[512];
+    uint32_t sectors[TF_MMAP_DIRTY_RANGES*2], step, i;
+    int r, covered;
+
+    // Nothing the filesystem has cached may be waiting for these sectors
+    if(tf_sync()) return DATA_WRITE_ERROR;
+    step = (image->sectors - tf_info.firstDataSector) / (TF_MMAP_DIRTY_RANGES*2);
+    if(step < 2) return DATA_MISMATCH_ERROR;
+    for(i=0; i<TF_MMAP_DIRTY_RANGES*2; i++) {
+        // Out of order, so that the ranges don't just grow one after the other
+        sectors[i] = tf_info.firstDataSector + (i*7 % (TF_MMAP_DIRTY_RANGES*2))*step;
+        if(tf_fetch(sectors[i])) return DATA_READ_ERROR;
+        if(tf_info.buffer != image->base + (size_t)sectors[i]*512) return DATA_MISMATCH_ERROR;
+    }
+    if(image->dev.flush(image)) return DATA_WRITE_ERROR;
+
+    for(i=0; i<TF_MMAP_DIRTY_RANGES*2; i++) {
+        if(image->dev.read(image, data, sectors[i], 1)) return DATA_READ_ERROR;
+        if(image->dev.write(image, data, sectors[i], 1)) return DATA_WRITE_ERROR;
+    }
+    if(image->dirtyRanges != TF_MMAP_DIRTY_RANGES) return DATA_MISMATCH_ERROR;
+    for(i=0; i<TF_MMAP_DIRTY_RANGES*2; i++) {
+        for(r=0, covered=0; r<image->dirtyRanges; r++) {
+            if(sectors[i] >= image->dirtyFirst[r] && sectors[i] <= image->dirtyLast[r]) covered = 1;
+        }
+        if(!covered) return DATA_MISMATCH_ERROR;
+    }
+    if(image->dev.flush(image) || image->dirtyRanges != 0) return DATA_WRITE_ERROR;
+    return NO_ERROR;
+}
+
+/*
+ * Read TEST_BATCH sectors spread over the disk in a single batch of one request each, and
+ * write them back unchanged the same way.  Then read TEST_BATCH consecutive sectors as a single
+ * request of one segment per sector.  Return 0 if the batches read what reading the sectors one
+ * at a time does, before and after the writes.
+ * Return an appropriate error code if there's any problem.
+ */
+int test_batch(void) {
+    uint8_t single[TEST_BATCH][512], batch[TEST_BATCH][512];
+    TFIOVec iov[TEST_BATCH];
+    TFBlockRequest reqs[TEST_BATCH];
+    uint32_t first = tf_info.firstDataSector, i;
+
+    // Nothing the filesystem has cached may be waiting for these sectors
+    if(tf_sync()) return DATA_WRITE_ERROR;
+    for(i=0; i<TEST_BATCH; i++) {
+        if(tf_info.dev->read(tf_info.dev->ctx, single[i], first + i*3, 1)) return DATA_READ_ERROR;
+        iov[i].data = batch[i];
+        iov[i].count = 1;
+        reqs[i].iov = &iov[i];
+        reqs[i].iovcnt = 1;
+        reqs[i].sector = first + i*3;
+        reqs[i].write = 0;
+    }
+    memset(batch, 0, sizeof(batch));
+    if(transfer_sectors(reqs, TEST_BATCH)) return DATA_READ_ERROR;
+    if(memcmp(batch, single, sizeof(batch))) return DATA_MISMATCH_ERROR;
+    for(i=0; i<TEST_BATCH; i++) reqs[i].write = 1;
+    if(transfer_sectors(reqs, TEST_BATCH)) return DATA_WRITE_ERROR;
+    for(i=0; i<TEST_BATCH; i++) {
+        if(tf_info.dev->read(tf_info.dev->ctx, single[i], first + i*3, 1)) return DATA_READ_ERROR;
+    }
+    if(memcmp(batch, single, sizeof(batch))) return DATA_MISMATCH_ERROR;
+
+    for(i=0; i<TEST_BATCH; i++) {
+        if(tf_info.dev->read(tf_info.dev->ctx, single[i], first + i, 1)) return DATA_READ_ERROR;
+    }
+    reqs[0].iov = iov;
+    reqs[0].iovcnt = TEST_BATCH;
+    reqs[0].sector = first;
+    reqs[0].write = 0;
+    memset(batch, 0, sizeof(batch));
+    if(transfer_sectors(reqs, 1)) return DATA_READ_ERROR;
+    if(memcmp(batch, single, sizeof(batch))) return DATA_MISMATCH_ERROR;
+    return NO_ERROR;
+}
+
+/*
+ * The byte at offset i of a pattern file
+ */
+uint8_t test_pattern(uint32_t i, int seed) {
+    return (uint8_t)(i * 7 + seed * 13 + (i >> 9));
+}
+
+/*
+ * Check that a buffer holds bytes pos to pos+size-1 of a pattern.
+ * Return an appropriate error code if there's any problem.
+ */
+int test_pattern_check(uint8_t *data, uint32_t pos, uint32_t size, int seed) {
+    uint32_t i;
+    for(i=0; i<size; i++) {
+        if(data[i] != test_pattern(pos + i, seed)) return DATA_MISMATCH_ERROR;
+    }
+    return NO_ERROR;
+}
+
+/*
+ * Write bytes pos to pos+size-1 of a pattern to an open file, where it is, 1000 at a time.
+ * Return an appropriate error code if there's any problem.
+ */
+int test_pattern_put(TFFile *fp, uint32_t pos, uint32_t size, int seed) {
+    uint8_t data[1000];
+    uint32_t end = pos + size, i, n;
+
+    for(; pos<end; pos+=n) {
+        n = (end - pos < sizeof(data)) ? end - pos : sizeof(data);
+        for(i=0; i<n; i++) data[i] = test_pattern(pos + i, seed);
+        if(tf_fwrite(data, 1, n, fp) < 1) return DATA_WRITE_ERROR;
+    }
+    return NO_ERROR;
+}
+
+/*
+ * Seek an open file to pos and read size bytes (no more than 8192), in one tf_fread().
+ * Return 0 if they are those bytes of a pattern.
+ * Return an appropriate error code if there's any problem.
+ */
+int test_pattern_fetch(TFFile *fp, uint32_t pos, uint32_t size, int seed) {
+    uint8_t data[8192];
+
+    if(size > sizeof(data)) return DATA_READ_ERROR;
+    if(tf_fseek(fp, 0, pos)) return DATA_READ_ERROR;
+    memset(data, ~test_pattern(pos, seed), size);
+    tf_fread(data, size, fp);
+    return test_pattern_check(data, pos, size, seed);
+}
+
+/*
+ * Open a file with the given mode and write size bytes of a pattern to it, 1000 at a time.
+ * Return an appropriate error code if there's any problem.
+ */
+int test_pattern_write(char *input_file, char *mode, uint32_t size, int seed) {
+    TFFile *fp;
+    int rc;
+
+    fp = tf_fopen(input_file, mode);
+    if(!fp) return FILE_OPEN_ERROR;
+    rc = test_pattern_put(fp, 0, size, seed);
+    tf_fclose(fp);
+    return rc;
+}
+
+/*
+ * Open a file and check that it holds size bytes of a pattern, reading 1000 at a time.
+ * Return an appropriate error code if there's any problem.
+ */
+int test_pattern_read(char *input_file, uint32_t size, int seed) {
+    TFFile *fp;
+    uint8_t data[1000];
+    uint32_t pos, n;
+    int rc = NO_ERROR;
+
+    fp = tf_fopen(input_file, "r");
+    if(!fp) return FILE_OPEN_ERROR;
+    if(fp->size != size) rc = DATA_MISMATCH_ERROR;
+    for(pos=0; pos<size && rc == NO_ERROR; pos+=n) {
+        n = (size - pos < sizeof(data)) ? size - pos : sizeof(data);
+        memset(data, ~test_pattern(pos, seed), n);
+        tf_fread(data, n, fp);
+        rc = test_pattern_check(data, pos, n, seed);
+    }
+    tf_fclose(fp);
+    return rc;
+}
+
+/*
+ * Write a pattern file over several clusters.  Read it back in single tf_fread() calls that
+ * start and end off sector boundaries, within a cluster and across several, then from start
+ * to end in odd sized pieces (which gets read ahead of).
+ * Return 0 if every read matches the pattern.
+ * Return an appropriate error code if there's any problem.
+ */
+int test_basic_unaligned_read(char *input_file, uint32_t size) {
+    TFFile *fp;
+    uint32_t clusterSize = tf_info.sectorsPerCluster*512, pos, n, i;
+    uint32_t spans[5][2] = {{1, 510}, {clusterSize - 7, 14}, {511, 2*clusterSize + 2},
+                            {3, 3*clusterSize + 5}, {clusterSize + 300, 8000}};
+    int rc = NO_ERROR;
+
+    if(rc = test_pattern_write(input_file, "w", size, 5)) return rc;
+    fp = tf_fopen(input_file, "r");
+    if(!fp) return FILE_OPEN_ERROR;
+    for(i=0; i<5 && rc == NO_ERROR; i++) {
+        pos = spans[i][0];
+        n = spans[i][1];
+        if(pos >= size) continue;
+        if(n > size - pos) n = size - pos;
+        if(n > 8192) n = 8192;
+        rc = test_pattern_fetch(fp, pos, n, 5);
+    }
+    for(pos=3; pos<size && rc == NO_ERROR; pos+=n) {
+        n = (size - pos < 777) ? size - pos : 777;
+        rc = test_pattern_fetch(fp, pos, n, 5);
+    }
+    tf_fclose(fp);
+    return rc;
+}
+
+/*
+ * Read a sector straight from the device, past every cache
+ * Return an appropriate error code if there's any problem.
+ */
+int test_read_sector(uint32_t sector, uint8_t *data) {
+    if(tf_info.dev->read(tf_info.dev->ctx, data, sector, 1)) return DATA_READ_ERROR;
+    return NO_ERROR;
+}
+
+/*
+ * Unmount the volume and count the free clusters in the FAT on disk, then mount it again.
+ * Return 0 if the FSInfo sector's free count is that count, and its next free hint is unknown
+ * (0xffffffff) or a cluster of the volume.
+ * Return an appropriate error code if there's any problem.
+ */
+int test_basic_fsinfo(void) {
+    uint8_t data[512];
+    uint32_t *entries = (uint32_t *)data;
+    uint32_t freeCount, nextFree, count=0, cluster;
+    int rc = NO_ERROR;
+
+    tf_unmount();
+    if(tf_info.fsinfoSector == 0) return tf_init(NULL) ? FILE_OPEN_ERROR : NO_ERROR;
+    if(test_read_sector(tf_info.fsinfoSector, data)) return DATA_READ_ERROR;
+    memcpy(&freeCount, &data[488], 4);
+    memcpy(&nextFree, &data[492], 4);
+    for(cluster=2; cluster<tf_info.totalClusters; cluster++) {
+        if(cluster % 128 == 0 || cluster == 2) {
+            if(test_read_sector(tf_info.fatStart + cluster/128, data)) return DATA_READ_ERROR;
+        }
+        if((entries[cluster % 128] & 0x0fffffff) == 0) count++;
+    }
+    if(freeCount != count) rc = DATA_MISMATCH_ERROR;
+    if(nextFree != 0xffffffff && (nextFree < 2 || nextFree >= tf_info.totalClusters)) rc = DATA_MISMATCH_ERROR;
+    if(tf_init(NULL)) return FILE_OPEN_ERROR;
+    return rc;
+}
+
+/*
+ * Write two files a cluster at a time in turns, so that their clusters alternate on disk, and
+ * remove the second one.  The first one is left with a run per cluster and a gap between each,
+ * more runs than a handle's extent map holds.  Read it at random offsets, forward and backward,
+ * then across every cluster boundary from the last one back to the first.
+ * Return 0 if the file is that fragmented and every read matches the pattern.
+ * Return an appropriate error code if there's any problem.
+ */
+int test_basic_seek(char *input_file, char *other_file) {
+    TFFile *fp, *other;
+    uint32_t clusterSize = tf_info.sectorsPerCluster*512, clusters = TF_FILE_EXTENTS*3;
+    uint32_t size = clusters*clusterSize - 100, pos, n, i, cluster, next, runs, seed = 1;
+    int rc = NO_ERROR;
+
+    fp = tf_fopen(input_file, "w");
+    if(!fp) return FILE_OPEN_ERROR;
+    other = tf_fopen(other_file, "w");
+    if(!other) {
+        tf_fclose(fp);
+        return FILE_OPEN_ERROR;
+    }
+    for(pos=0; pos<size && rc == NO_ERROR; pos+=n) {
+        n = (size - pos < clusterSize) ? size - pos : clusterSize;
+        rc = test_pattern_put(fp, pos, n, 6);
+        if(rc == NO_ERROR) rc = test_pattern_put(other, pos, n, 7);
+    }
+    tf_fclose(other);
+    tf_fclose(fp);
+    if(rc) return rc;
+    if(tf_remove(other_file)) return DATA_WRITE_ERROR;
+
+    fp = tf_fopen(input_file, "r");
+    if(!fp) return FILE_OPEN_ERROR;
+    for(runs=1, cluster=fp->startCluster; ; cluster=next) {
+        next = tf_get_fat_entry(cluster) & 0x0fffffff;
+        if(next < 2 || next >= tf_info.totalClusters) break;
+        if(next != cluster + 1) runs++;
+    }
+    if(runs <= TF_FILE_EXTENTS) rc = DATA_MISMATCH_ERROR;
+    for(i=0; i<200 && rc == NO_ERROR; i++) {
+        seed = seed*1103515245 + 12345;
+        pos = (seed >> 8) % size;
+        n = 1 + (seed >> 4) % 300;
+        if(n > size - pos) n = size - pos;
+        rc = test_pattern_fetch(fp, pos, n, 6);
+    }
+    for(i=clusters-1; i>0 && rc == NO_ERROR; i--) {
+        rc = test_pattern_fetch(fp, i*clusterSize - 5, 10, 6);
+    }
+    tf_fclose(fp);
+    return rc;
+}
+
+/*
+ * Create a file, reserve size bytes for it with tf_fallocate() and write them through the same
+ * handle.  Then truncate it, reserve as much again but only write a quarter before closing.
+ * Return 0 if the reservation took the clusters the file needed without changing its size,
+ * writing it took no more, closing gave back what the quarter didn't use, and the file reads
+ * back both times.
+ * Return an appropriate error code if there's any problem.
+ */
+int test_basic_fallocate(char *input_file, uint32_t size) {
+    TFFile *fp;
+    uint32_t before, reserved, clusters, clusterSize = tf_info.sectorsPerCluster*512;
+    int rc;
+
+    clusters = (size + clusterSize - 1) / clusterSize;
+    fp = tf_fopen(input_file, "w");
+    if(!fp) return FILE_OPEN_ERROR;
+    before = tf_free_clusters();
+    rc = tf_fallocate(fp, size);
+    reserved = before - tf_free_clusters();
+    // A new file already has its first cluster
+    if(rc == NO_ERROR && reserved != clusters - 1) rc = DATA_MISMATCH_ERROR;
+    if(rc == NO_ERROR) rc = test_pattern_put(fp, 0, size, 1);
+    if(rc == NO_ERROR && tf_free_clusters() != before - reserved) rc = DATA_MISMATCH_ERROR;
+    tf_fclose(fp);
+    if(rc) return rc;
+    if(rc = test_pattern_read(input_file, size, 1)) return rc;
+
+    fp = tf_fopen(input_file, "w");
+    if(!fp) return FILE_OPEN_ERROR;
+    before = tf_free_clusters();
+    rc = tf_fallocate(fp, size);
+    if(rc == NO_ERROR) rc = test_pattern_put(fp, 0, size/4, 3);
+    tf_fclose(fp);
+    if(rc) return rc;
+    // The first cluster was there before, the quarter needs the clusters up to its last byte
+    if(tf_free_clusters() != before - (size/4) / clusterSize) return DATA_MISMATCH_ERROR;
+    return test_pattern_read(input_file, size/4, 3);
+}
+
+/*
+ * Write a file opened with "wd", so that its clusters are only allocated when it is closed,
+ * then unmount and mount the volume again.  Return 0 if the file reads back, before and after.
+ * Return an appropriate error code if there's any problem.
+ */
+int test_basic_delayed(char *input_file, uint32_t size) {
+    int rc;
+
+    if(rc = test_pattern_write(input_file, "wd", size, 2)) return rc;
+    if(rc = test_pattern_read(input_file, size, 2)) return rc;
+    tf_unmount();
+    if(tf_init(NULL)) return FILE_OPEN_ERROR;
+    return test_pattern_read(input_file, size, 2);
+}
+
+/*
+ * Write a file of a given number of clusters and remove it.  Return 0 if every cluster of its
+ * chain is free afterwards, in the FAT and on disk once written back, and the free cluster count
+ * went back up by as many.
+ * Return an appropriate error code if there's any problem.
+ */
+int test_basic_remove_chain(char *input_file, uint32_t clusters) {
+    TFFile *fp;
+    uint8_t data[512];
+    uint32_t *entries = (uint32_t *)data;
+    uint32_t chain[TF_FREE_BATCH*4], count, cluster, sector, before, i;
+    int rc;
+
+    if(clusters > TF_FREE_BATCH*4) return DATA_MISMATCH_ERROR;
+    if(rc = test_pattern_write(input_file, "w", clusters*tf_info.sectorsPerCluster*512 - 1, 4)) return rc;
+    fp = tf_fopen(input_file, "r");
+    if(!fp) return FILE_OPEN_ERROR;
+    for(count=0, cluster=fp->startCluster; cluster >= 2 && cluster < tf_info.totalClusters; count++) {
+        if(count == TF_FREE_BATCH*4) break;
+        chain[count] = cluster;
+        cluster = tf_get_fat_entry(cluster) & 0x0fffffff;
+    }
+    tf_fclose(fp);
+    if(count != clusters) return DATA_MISMATCH_ERROR;
+
+    before = tf_free_clusters();
+    if(tf_remove(input_file)) return DATA_WRITE_ERROR;
+    if(tf_free_clusters() != before + count) return DATA_MISMATCH_ERROR;
+    for(i=0; i<count; i++) {
+        if(tf_get_fat_entry(chain[i]) & 0x0fffffff) return DATA_MISMATCH_ERROR;
+    }
+    if(tf_sync()) return DATA_WRITE_ERROR;
+    for(i=0, sector=0; i<count; i++) {
+        if(i == 0 || chain[i] / 128 != sector) {
+            sector = chain[i] / 128;
+            if(test_read_sector(tf_info.fatStart + sector, data)) return DATA_READ_ERROR;
+        }
+        if(entries[chain[i] % 128] & 0x0fffffff) return DATA_MISMATCH_ERROR;
+    }
+    return NO_ERROR;
+}
+
+/*
+ * Unmount the volume and compare the copies of the FAT on disk, then mount it again.
+ * Return 0 if every copy the boot sector lists (unless it turns mirroring off) is the same as
+ * the first, sector for sector.
+ * Return an appropriate error code if there's any problem.
+ */
+int test_basic_fat_mirror(void) {
+    uint8_t first[512], copy[512];
+    uint32_t sector, start, size, copies;
+    int i, rc = NO_ERROR;
+
+    tf_unmount();
+    // NumFATs, and ExtFlags bit 7 for a single active FAT, straight from the BPB
+    if(test_read_sector(0, first)) return DATA_READ_ERROR;
+    start = first[14] | (first[15] << 8);
+    copies = (first[40] & 0x80) ? 1 : first[16];
+    memcpy(&size, &first[36], 4);
+    for(sector=0; sector<size && rc == NO_ERROR; sector++) {
+        if(test_read_sector(start + sector, first)) rc = DATA_READ_ERROR;
+        for(i=1; i<copies && rc == NO_ERROR; i++) {
+            if(test_read_sector(start + i*size + sector, copy)) rc = DATA_READ_ERROR;
+            else if(memcmp(first, copy, sizeof(first))) rc = DATA_MISMATCH_ERROR;
+        }
+    }
+    if(tf_init(NULL)) return FILE_OPEN_ERROR;
+    return rc;
+}
+
+/*
+ * Run the FAT scan kernels (tf_fat_free_mask(), vectorised where the compiler allows, and the
+ * searches built on it) over entries in a few known patterns.  Some of the free entries have
+ * the reserved top 4 bits set, which don't count.  Every length of array is tried, up to past
+ * the last whole word of 32 entries, and runs are looked for with and without a run already
+ * going on from a previous array.
+ * Return 0 if every answer is the one a plain loop over the entries gives.
+ * Return an appropriate error code if there's any problem.
+ */
+int test_fat_kernels(void) {
+    uint32_t entries[128+13], values[6] = {0, 0xf0000000, 0x10000000, 5, 0x0ffffff8, 0xf0000001};
+    uint32_t lengths[9] = {1, 2, 5, 31, 32, 33, 40, 64, 100};
+    uint32_t pattern, count, bits, found, expect, run, expectRun, free, seed = 7, i, j, k;
+
+    for(pattern=0; pattern<6; pattern++) {
+        for(i=0; i<128+13; i++) {
+            seed = seed*1103515245 + 12345;
+            free = (seed >> 16) & 1 ? 0xf0000000 : 0;
+            if(pattern == 0) entries[i] = values[(seed >> 16) % 6];                 // a mix
+            else if(pattern == 1) entries[i] = free;                                // all free
+            else if(pattern == 2) entries[i] = i + 3;                               // all used
+            else if(pattern == 3) entries[i] = (i >= 40 && i < 110) ? free : 0x0ffffff8; // one run over several words
+            else if(pattern == 4) entries[i] = (i % 33 == 32) ? 0 : 0xf0000007;     // lone free entries
+            else entries[i] = (i < 130) ? 0x0fffffff : free;                        // free past the last whole word only
+        }
+        for(i=0; i+32 <= 128+13; i+=32) {
+            for(bits=0, j=0; j<32; j++) {
+                if((entries[i + j] & 0x0fffffff) == 0) bits |= 1u << j;
+            }
+            if(tf_fat_free_mask(&entries[i]) != bits) return DATA_MISMATCH_ERROR;
+        }
+        for(count=1; count<=128+13; count++) {
+            for(expect=count, found=0, i=0; i<count; i++) {
+                if(entries[i] & 0x0fffffff) continue;
+                if(expect == count) expect = i;
+                found++;
+            }
+            if(tf_fat_find_free(entries, count) != expect) return DATA_MISMATCH_ERROR;
+            if(tf_fat_count_free(entries, count) != found) return DATA_MISMATCH_ERROR;
+            for(j=0; j<9; j++) {
+                for(k=0; k<2; k++) {
+                    expectRun = k ? lengths[j] / 2 : 0;
+                    for(expect=count, i=0; i<count; i++) {
+                        if(entries[i] & 0x0fffffff) expectRun = 0;
+                        else if(++expectRun == lengths[j]) {
+                            expect = i;
+                            break;
+                        }
+                    }
+                    run = k ? lengths[j] / 2 : 0;
+                    if(tf_fat_find_run(entries, count, lengths[j], &run) != expect) return DATA_MISMATCH_ERROR;
+                    if(expect == count && run != expectRun) return DATA_MISMATCH_ERROR;
+                }
+            }
+        }
+    }
+    return NO_ERROR;
+}
+
+/*
+ * Open a file so that its directory entry is cached, remove it and create it again with other
+ * contents.  Return 0 if the cache held the entry, let go of it on removal, and holds the new
+ * one (with its new size) once it's opened.
+ * Return an appropriate error code if there's any problem.
+ */
+int test_basic_dentry(char *dir) {
+    TFFile *fp;
+    TFDentry *d;
+    char name[TF_MAX_PATH];
+    uint32_t cluster;
+    int rc;
+
+    if(tf_mkdir(dir, 0)) return FILE_OPEN_ERROR;
+    fp = tf_fopen(dir, "r");
+    if(!fp) return FILE_OPEN_ERROR;
+    cluster = fp->startCluster;
+    tf_fclose(fp);
+
+    sprintf(name, "%s/cached.txt", dir);
+    if(rc = test_basic_write(name, "Old contents")) return rc;
+    if(rc = test_basic_read(name, "Old contents")) return rc;
+    d = tf_dentry_lookup(cluster, "cached.txt", 10);
+    if(!d || d->size != 12) return DATA_MISMATCH_ERROR;
+
+    if(tf_remove(name)) return DATA_WRITE_ERROR;
+    if(tf_dentry_lookup(cluster, "cached.txt", 10)) return DATA_MISMATCH_ERROR;
+    if(fp = tf_fopen(name, "r")) {
+        tf_fclose(fp);
+        return DATA_MISMATCH_ERROR;
+    }
+
+    if(rc = test_basic_write(name, "New, longer contents")) return rc;
+    if(rc = test_basic_read(name, "New, longer contents")) return rc;
+    d = tf_dentry_lookup(cluster, "CACHED.TXT", 10);
+    if(!d || d->size != 20) return DATA_MISMATCH_ERROR;
+    return NO_ERROR;
+}
+
+/*
+ * Fill a new directory with count files and mount the volume again, so that the first lookup
+ * indexes it.  Then remove a file from the middle and create it again with other contents.
+ * Return 0 if the directory has a complete index after the first lookup and after the remove
+ * and the create, the removed file isn't found while it's gone, and every file reads back.
+ * Return an appropriate error code if there's any problem.
+ */
+int test_basic_index(char *dir, int count) {
+    TFFile *fp;
+    TFDirIndex *index;
+    char name[TF_MAX_PATH], contents[64];
+    uint32_t cluster;
+    int i, rc;
+
+    if(tf_mkdir(dir, 0)) return FILE_OPEN_ERROR;
+    for(i=0; i<count; i++) {
+        sprintf(name, "%s/indexed file %d.txt", dir, i);
+        sprintf(contents, "Contents of file %d", i);
+        if(rc = test_basic_write(name, contents)) return rc;
+    }
+    tf_unmount();
+    if(tf_init(NULL)) return FILE_OPEN_ERROR;
+
+    sprintf(name, "%s/indexed file 0.txt", dir);
+    if(rc = test_basic_read(name, "Contents of file 0")) return rc;
+    fp = tf_fopen(dir, "r");
+    if(!fp) return FILE_OPEN_ERROR;
+    cluster = fp->startCluster;
+    tf_fclose(fp);
+    index = tf_dir_index_get(cluster);
+    if(!index || !index->complete) return DATA_MISMATCH_ERROR;
+
+    sprintf(name, "%s/indexed file %d.txt", dir, count/2);
+    if(tf_remove(name)) return DATA_WRITE_ERROR;
+    if(fp = tf_fopen(name, "r")) {
+        tf_fclose(fp);
+        return DATA_MISMATCH_ERROR;
+    }
+    if(rc = test_basic_write(name, "Contents of the new file")) return rc;
+    index = tf_dir_index_get(cluster);
+    if(!index || !index->complete) return DATA_MISMATCH_ERROR;
+
+    for(i=0; i<count; i++) {
+        sprintf(name, "%s/indexed file %d.txt", dir, i);
+        if(i == count/2) strcpy(contents, "Contents of the new file");
+        else sprintf(contents, "Contents of file %d", i);
+        if(rc = test_basic_read(name, contents)) return rc;
+    }
+    return NO_ERROR;
+}
+
+/*
+ * Write a string to a file and close it, then mount the volume again without unmounting it
+ * first, as after a crash.  Return 0 if the file still has the string's size and contents.
+ * Return an appropriate error code if there's any problem.
+ */
+int test_basic_fclose_size(char *input_file, char *write_string) {
+    TFFile *fp;
+    uint32_t size;
+
+    if(test_basic_write(input_file, write_string)) return DATA_WRITE_ERROR;
+    // Forget everything cached, without writing it back
+    if(tf_init(NULL)) return FILE_OPEN_ERROR;
+    fp = tf_fopen(input_file, "r");
+    if(!fp) return FILE_OPEN_ERROR;
+    size = fp->size;
+    tf_fclose(fp);
+    if(size != strlen(write_string)) return DATA_MISMATCH_ERROR;
+    return test_basic_read(input_file, write_string);
+}
+
+/*
+ * Create three files in a new directory, remove the middle one and create another with a name
+ * as long, which has to take the removed one's records.  Where the new entry goes is also
+ * looked for with the directory's name index dropped, which has to find the same records.
+ * Return 0 if the new entry is there, the files on either side of it are intact, the removed
+ * one is gone and the directory didn't grow.
+ * Return an appropriate error code if there's any problem.
+ */
+int test_basic_reuse(char *dir) {
+    TFFile *fp;
+    char name[TF_MAX_PATH];
+    uint8_t record[32];
+    uint32_t end, pos, i;
+    int rc;
+
+    if(tf_mkdir(dir, 0)) return FILE_OPEN_ERROR;
+    sprintf(name, "%s/a.txt", dir);
+    if(rc = test_basic_write(name, "This is file A")) return rc;
+    sprintf(name, "%s/b.txt", dir);
+    if(rc = test_basic_write(name, "This is file B")) return rc;
+    sprintf(name, "%s/c.txt", dir);
+    if(rc = test_basic_write(name, "This is file C")) return rc;
+    // Mount again, so that nothing is known about the directory
+    tf_unmount();
+    if(tf_init(NULL)) return FILE_OPEN_ERROR;
+
+    sprintf(name, "%s/b.txt", dir);
+    if(tf_remove(name)) return DATA_WRITE_ERROR;
+
+    // Without an index, the directory is searched for the deleted records
+    fp = tf_fopen(dir, "r");
+    if(!fp) return FILE_OPEN_ERROR;
+    for(end=0; !tf_fread(record, sizeof(record), fp) && record[0]; end+=sizeof(record));
+    tf_dir_index_drop(fp->startCluster);
+    tf_fseek(fp, 0, 0);
+    if(tf_dir_seek_free(fp, 2) != 1) {
+        tf_fclose(fp);
+        return DATA_MISMATCH_ERROR;
+    }
+    pos = fp->pos;
+    tf_fclose(fp);
+
+    // tf_create() indexes the directory again, and has to put the new entry at the same place
+    sprintf(name, "%s/d.txt", dir);
+    if(rc = test_basic_write(name, "This is file D")) return rc;
+    fp = tf_fopen(dir, "r");
+    if(!fp) return FILE_OPEN_ERROR;
+    tf_fseek(fp, 0, pos);
+    tf_fread(record, sizeof(record), fp);
+    rc = (record[11] != 0x0f);
+    tf_fread(record, sizeof(record), fp);
+    rc |= (record[0] != 'D');
+    tf_fseek(fp, 0, 0);
+    for(i=0; !tf_fread(record, sizeof(record), fp) && record[0]; i+=sizeof(record));
+    tf_fclose(fp);
+    if(rc || i != end) return DATA_MISMATCH_ERROR;
+
+    sprintf(name, "%s/b.txt", dir);
+    if(fp = tf_fopen(name, "r")) {
+        tf_fclose(fp);
+        return DATA_MISMATCH_ERROR;
+    }
+    sprintf(name, "%s/a.txt", dir);
+    if(rc = test_basic_read(name, "This is file A")) return rc;
+    sprintf(name, "%s/c.txt", dir);
+    if(rc = test_basic_read(name, "This is file C")) return rc;
+    sprintf(name, "%s/d.txt", dir);
+    return test_basic_read(name, "This is file D");
+}
@@ -0,0 +1,212 @@
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tf_host.h"
+
+static int tf_host_read(void *ctx, uint8_t *data, uint32_t sector, uint32_t count) {
+    TFHostDevice *host = (TFHostDevice *) ctx;
+    if(pread(host->fd, data, (size_t)count*512, (off_t)sector*512) != (ssize_t)count*512) return -1;
+    return 0;
+}
+
+static int tf_host_write(void *ctx, uint8_t *data, uint32_t sector, uint32_t count) {
+    TFHostDevice *host = (TFHostDevice *) ctx;
+    if(pwrite(host->fd, data, (size_t)count*512, (off_t)sector*512) != (ssize_t)count*512) return -1;
+    return 0;
+}
+
+// Vectored transfers map straight onto preadv()/pwritev(), TF_HOST_IOV segments per syscall
+#define TF_HOST_IOV 64
+
+static int tf_host_transferv(TFHostDevice *host, const TFIOVec *iov, int iovcnt, uint32_t sector, int write) {
+    struct iovec v[TF_HOST_IOV];
+    ssize_t bytes, rc;
+    int i, n;
+    while(iovcnt > 0) {
+        n = (iovcnt < TF_HOST_IOV) ? iovcnt : TF_HOST_IOV;
+        bytes = 0;
+        for(i=0; i<n; i++) {
+            v[i].iov_base = iov[i].data;
+            v[i].iov_len = (size_t)iov[i].count*512;
+            bytes += v[i].iov_len;
+        }
+        if(write) rc = pwritev(host->fd, v, n, (off_t)sector*512);
+        else      rc = preadv(host->fd, v, n, (off_t)sector*512);
+        if(rc != bytes) return -1;
+        sector += bytes/512;
+        iov += n;
+        iovcnt -= n;
+    }
+    return 0;
+}
+
+static int tf_host_readv(void *ctx, const TFIOVec *iov, int iovcnt, uint32_t sector) {
+    return tf_host_transferv((TFHostDevice *) ctx, iov, iovcnt, sector, 0);
+}
+
+static int tf_host_writev(void *ctx, const TFIOVec *iov, int iovcnt, uint32_t sector) {
+    return tf_host_transferv((TFHostDevice *) ctx, iov, iovcnt, sector, 1);
+}
+
+static int tf_host_flush(void *ctx) {
+    TFHostDevice *host = (TFHostDevice *) ctx;
+    return fdatasync(host->fd);
+}
+
+/*
+ * Open an image file and set up host->dev so it can be passed to tf_init()
+ * ARGS
+ *   host - storage for the device, must outlive the mounted filesystem
+ *   path - path of the FAT32 image
+ * RETURN
+ *   0 for NO ERROR, nonzero if the image couldn't be opened
+ */
+int tf_host_open(TFHostDevice *host, const char *path) {
+    host->fd = open(path, O_RDWR);
+    if(host->fd < 0) {
+        dbg_printf("\r\n[DEBUG-tf_host_open] Could not open image '%s'", path);
+        return -1;
+    }
+    host->dev.read = tf_host_read;
+    host->dev.write = tf_host_write;
+    host->dev.readv = tf_host_readv;
+    host->dev.writev = tf_host_writev;
+    host->dev.flush = tf_host_flush;
+    host->dev.submit = NULL;
+    host->dev.map = NULL;
+    host->dev.ctx = host;
+    return 0;
+}
+
+/*
+ * Flush and close an image opened with tf_host_open()
+ * RETURN
+ *   0 for NO ERROR, nonzero otherwise
+ */
+int tf_host_close(TFHostDevice *host) {
+    int rc;
+    if(host->fd < 0) return 0;
+    rc = tf_host_flush(host);
+    rc |= close(host->fd);
+    host->fd = -1;
+    return rc;
+}
+
+// Record sectors first..last as needing an msync().  Ranges that touch are merged; once every
+// slot is taken the new range is folded into the nearest one.
+static void tf_mmap_mark_dirty(TFMmapDevice *image, uint32_t first, uint32_t last) {
+    int i, nearest = 0;
+    uint32_t gap, nearestGap = 0xffffffff;
+    for(i=0; i<image->dirtyRanges; i++) {
+        if(first <= image->dirtyLast[i] + 1 && last + 1 >= image->dirtyFirst[i]) break;
+        gap = (first > image->dirtyLast[i]) ? first - image->dirtyLast[i] : image->dirtyFirst[i] - last;
+        if(gap < nearestGap) {
+            nearestGap = gap;
+            nearest = i;
+        }
+    }
+    if(i == image->dirtyRanges) {
+        if(image->dirtyRanges < TF_MMAP_DIRTY_RANGES) {
+            image->dirtyFirst[i] = first;
+            image->dirtyLast[i] = last;
+            image->dirtyRanges++;
+            return;
+        }
+        i = nearest;
+    }
+    if(first < image->dirtyFirst[i]) image->dirtyFirst[i] = first;
+    if(last > image->dirtyLast[i]) image->dirtyLast[i] = last;
+}
+
+static int tf_mmap_read(void *ctx, uint8_t *data, uint32_t sector, uint32_t count) {
+    TFMmapDevice *image = (TFMmapDevice *) ctx;
+    if(sector >= image->sectors || count > image->sectors - sector) return -1;
+    memcpy(data, image->base + (size_t)sector*512, (size_t)count*512);
+    return 0;
+}
+
+static int tf_mmap_write(void *ctx, uint8_t *data, uint32_t sector, uint32_t count) {
+    TFMmapDevice *image = (TFMmapDevice *) ctx;
+    uint8_t *dest;
+    if(sector >= image->sectors || count > image->sectors - sector) return -1;
+    // Sectors handed out by tf_mmap_map() come back already modified in place
+    dest = image->base + (size_t)sector*512;
+    if(data != dest) memcpy(dest, data, (size_t)count*512);
+    tf_mmap_mark_dirty(image, sector, sector + count - 1);
+    return 0;
+}
+
+static uint8_t *tf_mmap_map(void *ctx, uint32_t sector) {
+    TFMmapDevice *image = (TFMmapDevice *) ctx;
+    if(sector >= image->sectors) return NULL;
+    return image->base + (size_t)sector*512;
+}
+
+static int tf_mmap_flush(void *ctx) {
+    TFMmapDevice *image = (TFMmapDevice *) ctx;
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t start, end;
+    int i, rc = 0;
+    for(i=0; i<image->dirtyRanges; i++) {
+        start = ((size_t)image->dirtyFirst[i]*512) & ~(page - 1);  // msync() wants page alignment
+        end = ((size_t)image->dirtyLast[i] + 1)*512;
+        rc |= msync(image->base + start, end - start, MS_SYNC);
+    }
+    image->dirtyRanges = 0;
+    return rc;
+}
+
+/*
+ * Map an image file and set up image->dev so it can be passed to tf_init()
+ * ARGS
+ *   image - storage for the device, must outlive the mounted filesystem
+ *   path - path of the FAT32 image
+ * RETURN
+ *   0 for NO ERROR, nonzero if the image couldn't be opened or mapped
+ */
+int tf_mmap_open(TFMmapDevice *image, const char *path) {
+    struct stat st;
+    image->fd = open(path, O_RDWR);
+    if(image->fd < 0 || fstat(image->fd, &st) || st.st_size < 512) {
+        dbg_printf("\r\n[DEBUG-tf_mmap_open] Could not open image '%s'", path);
+        if(image->fd >= 0) close(image->fd);
+        image->fd = -1;
+        return -1;
+    }
+    image->sectors = st.st_size / 512;
+    image->base = mmap(NULL, (size_t)image->sectors*512, PROT_READ | PROT_WRITE, MAP_SHARED, image->fd, 0);
+    if(image->base == MAP_FAILED) {
+        dbg_printf("\r\n[DEBUG-tf_mmap_open] Could not map image '%s'", path);
+        close(image->fd);
+        image->fd = -1;
+        return -1;
+    }
+    image->dirtyRanges = 0;
+    image->dev.read = tf_mmap_read;
+    image->dev.write = tf_mmap_write;
+    image->dev.readv = NULL;
+    image->dev.writev = NULL;
+    image->dev.flush = tf_mmap_flush;
+    image->dev.submit = NULL;
+    image->dev.map = tf_mmap_map;
+    image->dev.ctx = image;
+    return 0;
+}
+
+/*
+ * Flush, unmap and close an image opened with tf_mmap_open()
+ * RETURN
+ *   0 for NO ERROR, nonzero otherwise
+ */
+int tf_mmap_close(TFMmapDevice *image) {
+    int rc;
+    if(image->fd < 0) return 0;
+    rc = tf_mmap_flush(image);
+    rc |= munmap(image->base, (size_t)image->sectors*512);
+    rc |= close(image->fd);
+    image->fd = -1;
+    return rc;
+}
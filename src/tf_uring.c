@@ -0,0 +1,203 @@
+#include "tf_uring.h"
+#ifdef TF_HAVE_IO_URING
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static int tf_uring_read(void *ctx, uint8_t *data, uint32_t sector, uint32_t count) {
+    TFUringDevice *uring = (TFUringDevice *) ctx;
+    if(pread(uring->fd, data, (size_t)count*512, (off_t)sector*512) != (ssize_t)count*512) return -1;
+    return 0;
+}
+
+static int tf_uring_write(void *ctx, uint8_t *data, uint32_t sector, uint32_t count) {
+    TFUringDevice *uring = (TFUringDevice *) ctx;
+    if(pwrite(uring->fd, data, (size_t)count*512, (off_t)sector*512) != (ssize_t)count*512) return -1;
+    return 0;
+}
+
+static int tf_uring_flush(void *ctx) {
+    TFUringDevice *uring = (TFUringDevice *) ctx;
+    return fdatasync(uring->fd);
+}
+
+/*
+ * Run a batch through the ring.  Requests are cut into operations of up to TF_URING_IOV
+ * segments, as many operations as there are free slots are queued and submitted, and each
+ * completion reaped frees a slot for the next operation.
+ * If the ring can't be entered, nothing more is queued: the operations the kernel hasn't taken
+ * are taken back, and the ones it has are still reaped, as they may be using the caller's
+ * buffers until they complete.
+ * RETURN
+ *   0 if every operation transferred all of its data, nonzero otherwise
+ */
+static int tf_uring_submit(void *ctx, const TFBlockRequest *reqs, int count) {
+    TFUringDevice *uring = (TFUringDevice *) ctx;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    uint32_t tail, head, sector = 0, bytes;
+    int i = 0, seg = 0, n, k, slot, queued = 0, inflight = 0, failed = 0, rc = 0;
+    long submitted;
+
+    if(count > 0) sector = reqs[0].sector;
+    while((i < count && !failed) || inflight > 0) {
+        tail = *uring->sqTail;
+        while(i < count && !failed && uring->freeSlots > 0) {
+            slot = uring->freeSlot[--uring->freeSlots];
+            n = reqs[i].iovcnt - seg;
+            if(n > TF_URING_IOV) n = TF_URING_IOV;
+            bytes = 0;
+            for(k=0; k<n; k++) {
+                uring->iov[slot][k].iov_base = reqs[i].iov[seg + k].data;
+                uring->iov[slot][k].iov_len = (size_t)reqs[i].iov[seg + k].count*512;
+                bytes += reqs[i].iov[seg + k].count*512;
+            }
+            sqe = &uring->sqes[tail & *uring->sqMask];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = reqs[i].write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->fd = uring->fd;
+            sqe->off = (uint64_t)sector*512;
+            sqe->addr = (uint64_t)(uintptr_t)uring->iov[slot];
+            sqe->len = n;
+            sqe->user_data = slot;
+            uring->sqArray[tail & *uring->sqMask] = tail & *uring->sqMask;
+            uring->expected[slot] = bytes;
+            tail++;
+            queued++;
+            inflight++;
+            sector += bytes/512;
+            seg += n;
+            if(seg == reqs[i].iovcnt) {
+                seg = 0;
+                if(++i < count) sector = reqs[i].sector;
+            }
+        }
+        __atomic_store_n(uring->sqTail, tail, __ATOMIC_RELEASE);
+
+        // Submit whatever is queued and wait for at least one completion
+        submitted = syscall(__NR_io_uring_enter, uring->ring, queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if(submitted >= 0) queued -= submitted;
+        else if(errno != EINTR && !failed) {
+            dbg_printf("\r\n[DEBUG-tf_uring_submit] io_uring_enter failed (%d)", errno);
+            failed = 1;
+            rc = -1;
+            // The kernel only looks at the queue when entered, what it didn't take can go
+            for(; queued > 0; queued--) {
+                tail--;
+                uring->freeSlot[uring->freeSlots++] = (int) uring->sqes[tail & *uring->sqMask].user_data;
+                inflight--;
+            }
+            __atomic_store_n(uring->sqTail, tail, __ATOMIC_RELEASE);
+        }
+
+        head = *uring->cqHead;
+        while(head != __atomic_load_n(uring->cqTail, __ATOMIC_ACQUIRE)) {
+            cqe = &uring->cqes[head & *uring->cqMask];
+            slot = (int) cqe->user_data;
+            if(cqe->res < 0 || (uint32_t)cqe->res != uring->expected[slot]) rc = -1;
+            uring->freeSlot[uring->freeSlots++] = slot;
+            inflight--;
+            head++;
+        }
+        __atomic_store_n(uring->cqHead, head, __ATOMIC_RELEASE);
+    }
+    return rc;
+}
+
+/*
+ * Open an image file, set up a ring for it and fill in uring->dev so it can be passed to tf_init()
+ * ARGS
+ *   uring - storage for the device, must outlive the mounted filesystem
+ *   path - path of the FAT32 image (or block device)
+ * RETURN
+ *   0 for NO ERROR, nonzero if the image couldn't be opened or the kernel has no io_uring
+ */
+int tf_uring_open(TFUringDevice *uring, const char *path) {
+    struct io_uring_params p;
+    uint8_t *sq, *cq;
+    int i;
+
+    uring->fd = open(path, O_RDWR);
+    if(uring->fd < 0) {
+        dbg_printf("\r\n[DEBUG-tf_uring_open] Could not open image '%s'", path);
+        return -1;
+    }
+    memset(&p, 0, sizeof(p));
+    uring->ring = (int) syscall(__NR_io_uring_setup, TF_URING_DEPTH, &p);
+    if(uring->ring < 0) {
+        dbg_printf("\r\n[DEBUG-tf_uring_open] io_uring_setup failed (%d)", errno);
+        close(uring->fd);
+        uring->fd = -1;
+        return -1;
+    }
+
+    uring->sqRingSize = p.sq_off.array + p.sq_entries*sizeof(uint32_t);
+    uring->cqRingSize = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        if(uring->cqRingSize > uring->sqRingSize) uring->sqRingSize = uring->cqRingSize;
+        uring->cqRingSize = uring->sqRingSize;
+    }
+    uring->sqesSize = p.sq_entries*sizeof(struct io_uring_sqe);
+    uring->sqRing = mmap(NULL, uring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         uring->ring, IORING_OFF_SQ_RING);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) uring->cqRing = uring->sqRing;
+    else uring->cqRing = mmap(NULL, uring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                              uring->ring, IORING_OFF_CQ_RING);
+    uring->sqes = mmap(NULL, uring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       uring->ring, IORING_OFF_SQES);
+    if(uring->sqRing == MAP_FAILED || uring->cqRing == MAP_FAILED || uring->sqes == MAP_FAILED) {
+        dbg_printf("\r\n[DEBUG-tf_uring_open] Could not map the rings");
+        if(uring->sqes != MAP_FAILED) munmap(uring->sqes, uring->sqesSize);
+        if(uring->cqRing != MAP_FAILED && uring->cqRing != uring->sqRing) munmap(uring->cqRing, uring->cqRingSize);
+        if(uring->sqRing != MAP_FAILED) munmap(uring->sqRing, uring->sqRingSize);
+        close(uring->ring);
+        close(uring->fd);
+        uring->fd = -1;
+        return -1;
+    }
+    sq = (uint8_t *) uring->sqRing;
+    cq = (uint8_t *) uring->cqRing;
+    uring->sqHead = (uint32_t *)(sq + p.sq_off.head);
+    uring->sqTail = (uint32_t *)(sq + p.sq_off.tail);
+    uring->sqMask = (uint32_t *)(sq + p.sq_off.ring_mask);
+    uring->sqArray = (uint32_t *)(sq + p.sq_off.array);
+    uring->cqHead = (uint32_t *)(cq + p.cq_off.head);
+    uring->cqTail = (uint32_t *)(cq + p.cq_off.tail);
+    uring->cqMask = (uint32_t *)(cq + p.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    for(i=0; i<TF_URING_DEPTH; i++) uring->freeSlot[i] = i;
+    uring->freeSlots = TF_URING_DEPTH;
+
+    uring->dev.read = tf_uring_read;
+    uring->dev.write = tf_uring_write;
+    uring->dev.readv = NULL;
+    uring->dev.writev = NULL;
+    uring->dev.flush = tf_uring_flush;
+    uring->dev.submit = tf_uring_submit;
+    uring->dev.map = NULL;
+    uring->dev.ctx = uring;
+    return 0;
+}
+
+/*
+ * Flush and close an image opened with tf_uring_open(), tearing down its ring
+ * RETURN
+ *   0 for NO ERROR, nonzero otherwise
+ */
+int tf_uring_close(TFUringDevice *uring) {
+    int rc;
+    if(uring->fd < 0) return 0;
+    rc = tf_uring_flush(uring);
+    munmap(uring->sqes, uring->sqesSize);
+    if(uring->cqRing != uring->sqRing) munmap(uring->cqRing, uring->cqRingSize);
+    munmap(uring->sqRing, uring->sqRingSize);
+    rc |= close(uring->ring);
+    rc |= close(uring->fd);
+    uring->fd = -1;
+    return rc;
+}
+#endif
@@ -1,27 +1,87 @@
 
 #include <string.h>
 #include <stdio.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if TF_MOUNT_THREADS > 0
+#include <pthread.h>
+#endif
 #include "thinfat32.h"
 #include "fat32_ui.h"
 #include "thinternal.h"
 
 // USERLAND
+// All sector I/O goes through the block device registered with tf_init()
 int read_sector(uint8_t *data, uint32_t sector) {
-    FILE *fp;
-    fp = fopen("test.fat32", "r+b");
-    fseek(fp, sector*512, 0);
-    fread(data, 1, 512, fp);
-    fclose(fp);
-    return 0;
+    return tf_info.dev->read(tf_info.dev->ctx, data, sector, 1);
 }
 
 int write_sector(uint8_t *data, uint32_t blocknum) {
-    FILE *fp;
-    fp = fopen("test.fat32", "r+");
-    fseek(fp, blocknum*512, 0);
-    fwrite(data, 1, 512, fp);
-    fclose(fp);
-    return 0;
+    return tf_info.dev->write(tf_info.dev->ctx, data, blocknum, 1);
+}
+
+// Transfer count consecutive sectors in one device call
+int read_sectors(uint8_t *data, uint32_t blocknum, uint32_t count) {
+    return tf_info.dev->read(tf_info.dev->ctx, data, blocknum, count);
+}
+
+int write_sectors(uint8_t *data, uint32_t blocknum, uint32_t count) {
+    return tf_info.dev->write(tf_info.dev->ctx, data, blocknum, count);
+}
+
+/*
+ * Vectored transfers: the segments of iov map onto consecutive sectors starting at blocknum.
+ * Devices without readv/writev get one read()/write() per segment.
+ * RETURN
+ *   zero for NO ERROR, nonzero otherwise
+ */
+int read_sectorsv(const TFIOVec *iov, int iovcnt, uint32_t blocknum) {
+    int i, rc=0;
+    if(tf_info.dev->readv) return tf_info.dev->readv(tf_info.dev->ctx, iov, iovcnt, blocknum);
+    for(i=0; i<iovcnt; i++) {
+        rc |= read_sectors(iov[i].data, blocknum, iov[i].count);
+        blocknum += iov[i].count;
+    }
+    return rc;
+}
+
+int write_sectorsv(const TFIOVec *iov, int iovcnt, uint32_t blocknum) {
+    int i, rc=0;
+    if(tf_info.dev->writev) return tf_info.dev->writev(tf_info.dev->ctx, iov, iovcnt, blocknum);
+    for(i=0; i<iovcnt; i++) {
+        rc |= write_sectors(iov[i].data, blocknum, iov[i].count);
+        blocknum += iov[i].count;
+    }
+    return rc;
+}
+
+/*
+ * Hand a batch of requests to the device, which may have all of them in flight at once.
+ * Devices without submit() get the requests one at a time, in order.
+ * RETURN
+ *   zero if every request succeeded, nonzero otherwise
+ */
+int transfer_sectors(const TFBlockRequest *reqs, int count) {
+    int i, rc=0;
+    if(tf_info.dev->submit) return tf_info.dev->submit(tf_info.dev->ctx, reqs, count);
+    for(i=0; i<count; i++) {
+        if(reqs[i].write) rc |= write_sectorsv(reqs[i].iov, reqs[i].iovcnt, reqs[i].sector);
+        else              rc |= read_sectorsv(reqs[i].iov, reqs[i].iovcnt, reqs[i].sector);
+    }
+    return rc;
+}
+
+/*
+ * Ask the block device to commit anything it has buffered to the media.
+ * RETURN
+ *   the return code given by the device's flush() (zero if the device has no flush callback)
+ */
+int flush_device(void) {
+    if(tf_info.dev->flush == NULL) return 0;
+    return tf_info.dev->flush(tf_info.dev->ctx);
 }
 
 
@@ -29,47 +89,472 @@ int write_sector(uint8_t *data, uint32_t blocknum) {
 
 TFInfo tf_info;
 TFFile tf_file_handles[TF_FILE_HANDLES];
+TFCacheEntry tf_cache_entries[TF_CACHE_SETS*TF_CACHE_WAYS];
+uint8_t tf_cache_data[TF_CACHE_SETS*TF_CACHE_WAYS][512];
+#if TF_FREEMAP_CLUSTERS > 0
+uint32_t tf_freemap[TF_FREEMAP_CLUSTERS/32];             // one bit per cluster, set if the cluster is in use
+uint32_t tf_freemap_summary[TF_FREEMAP_CLUSTERS/32/32];  // one bit per tf_freemap word, set if it has a free cluster
+#else
+uint32_t tf_freemap[1];                                  // no bitmap, tf_freemap_build() never builds one
+uint32_t tf_freemap_summary[1];
+#endif
+TFCacheEntry tf_fat_cache_entries[TF_FAT_CACHE_SETS*TF_FAT_CACHE_WAYS];
+uint8_t tf_fat_cache_data[TF_FAT_CACHE_SETS*TF_FAT_CACHE_WAYS][512];
+TFDentry tf_dentries[TF_DENTRY_SETS*TF_DENTRY_WAYS];
+TFDirIndex tf_dir_indexes[TF_DIR_INDEXES];
+#if TF_MOUNT_THREADS > 0
+#if TF_MOUNT_SCAN_RUN % 8
+#error "TF_MOUNT_SCAN_RUN must be a multiple of 8, so that no two threads share a word of tf_freemap_summary"
+#endif
+// One scanner per extra thread, plus one for the thread calling tf_freemap_build()
+typedef struct struct_TFMountScan {
+    uint32_t *entries;          // TF_MOUNT_SCAN_RUN sectors of tf_mount_entries
+    uint32_t free;
+    int rc;
+} TFMountScan;
+TFMountScan tf_mount_scans[TF_MOUNT_THREADS + 1];
+uint32_t tf_mount_entries[TF_MOUNT_THREADS + 1][TF_MOUNT_SCAN_RUN*128];
+uint32_t tf_mount_next;         // first FAT sector no scanner has claimed yet
+#endif
 #ifdef TF_DEBUG
 TFStats tf_stats;
 #endif
 
+/*
+ * Set up an empty sector cache
+ * ARGS
+ *   cache - the cache to set up
+ *   entries - storage for sets*ways entries
+ *   data - storage for sets*ways sectors (sets*ways*512 bytes)
+ *   sets - number of sets, must be a power of two
+ *   ways - number of sectors each set can hold
+ * SIDE EFFECTS
+ *   Anything the cache held before is dropped, dirty or not
+ *   dirtyLimit is set to the size of the cache, so that only evictions cause write backs
+ */
+void tf_cache_init(TFCache *cache, TFCacheEntry *entries, uint8_t *data, uint32_t sets, uint32_t ways) {
+    uint32_t i;
+    cache->sets = sets;
+    cache->ways = ways;
+    cache->clock = 0;
+    cache->dirtyLimit = sets*ways;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->entries = entries;
+    for(i=0; i<sets*ways; i++) {
+        entries[i].sector = TF_CACHE_EMPTY;
+        entries[i].lastUse = 0;
+        entries[i].flags = 0;
+        entries[i].data = data + i*512;
+    }
+}
+
+/*
+ * Find the entry a sector lives in
+ * ARGS
+ *   cache - the cache to look in
+ *   sector - the sector wanted
+ * RETURN
+ *   The entry holding the sector if it is cached.  Otherwise, the entry of the sector's set it
+ *   should go in (an empty one, else the least recently used): compare its sector to tell.
+ */
+TFCacheEntry *tf_cache_lookup(TFCache *cache, uint32_t sector) {
+    TFCacheEntry *e, *victim;
+    uint32_t i;
+
+    e = victim = &cache->entries[(sector & (cache->sets-1)) * cache->ways];
+    for(i=0; i<cache->ways; i++, e++) {
+        if(e->sector == sector) return e;
+        // Empty entries are taken first, then the one that has gone unused the longest
+        if(e->sector == TF_CACHE_EMPTY) victim = e;
+        else if(victim->sector != TF_CACHE_EMPTY && e->lastUse < victim->lastUse) victim = e;
+    }
+    return victim;
+}
+
+/*
+ * Hand a cache entry over to a new sector, whose contents the caller then fills in
+ * ARGS
+ *   cache - the cache the entry belongs to
+ *   entry - the entry, as returned by tf_cache_lookup()
+ *   sector - the sector the entry will hold
+ * SIDE EFFECTS
+ *   If the entry was dirty, or the cache holds dirtyLimit dirty entries, the cache is
+ *   tf_cache_flush()ed first.  If it holds a sector of a delayed cluster, that cluster's file
+ *   allocates its clusters first (see tf_delay_evict()).  The entry is clean and counts as just used.
+ * RETURN
+ *   0 for NO ERROR, nonzero if writing back dirty sectors failed
+ */
+int tf_cache_claim(TFCache *cache, TFCacheEntry *entry, uint32_t sector) {
+    uint32_t i, dirty=0;
+    int rc=0;
+
+    // A sector of a delayed cluster can only leave once its file has allocated the clusters
+    if(cache == &tf_info.cache && entry->sector != TF_CACHE_EMPTY && tf_delay_sector(entry->sector)) {
+        rc |= tf_delay_evict(entry);
+    }
+    if(!(entry->flags & TF_FLAG_DIRTY) && cache->dirtyLimit < cache->sets*cache->ways) {
+        for(i=0; i<cache->sets*cache->ways; i++) {
+            if(!(cache->entries[i].flags & TF_FLAG_DIRTY)) continue;
+            if(cache != &tf_info.cache || !tf_delay_sector(cache->entries[i].sector)) dirty++;
+        }
+    }
+    if((entry->flags & TF_FLAG_DIRTY) || dirty >= cache->dirtyLimit) {
+        dbg_printf("\r\n[DEBUG-tf_cache_claim] Making room for sector (%d)... writing back dirty sectors.", sector);
+        rc |= tf_cache_flush(cache);
+    }
+    entry->sector = sector;
+    entry->lastUse = ++cache->clock;
+    entry->flags = 0;
+    return rc;
+}
+
+/*
+ * Find a sector in the cache, reading it in if it isn't there yet
+ * ARGS
+ *   cache - the cache to look in
+ *   sector - the sector wanted
+ *   entry - set to the entry that holds the sector
+ * SIDE EFFECTS
+ *   On a miss, an entry of the sector's set is tf_cache_claim()ed for it, which may write back
+ *   the cache's dirty sectors.  If the read fails the entry is left empty.
+ * RETURN
+ *   0 for NO ERROR, nonzero if writing back dirty sectors or reading the new one failed
+ */
+int tf_cache_fetch(TFCache *cache, uint32_t sector, TFCacheEntry **entry) {
+    TFCacheEntry *e;
+    int rc;
+
+    *entry = e = tf_cache_lookup(cache, sector);
+    if(e->sector == sector) {
+        e->lastUse = ++cache->clock;
+        cache->hits += 1;
+        return 0;
+    }
+    cache->misses += 1;
+
+    rc = tf_cache_claim(cache, e, sector);
+    dbg_printf("\r\n[DEBUG-tf_cache_fetch] Fetching sector (%d) from disk.", sector);
+    #ifdef TF_DEBUG
+    tf_stats.sector_reads += 1;
+    #endif
+    if(read_sector(e->data, sector)) {
+        e->sector = TF_CACHE_EMPTY;
+        rc |= 1;
+    }
+    return rc;
+}
+
+/*
+ * Read a run of sectors into the cache ahead of their use
+ * ARGS
+ *   cache - the cache to fill
+ *   sector - the first sector of the run
+ *   count - number of sectors in the run, at most TF_READAHEAD_MAX and half the cache
+ * SIDE EFFECTS
+ *   Sectors of the run that aren't cached yet get an entry each (see tf_cache_claim()) and are
+ *   read in a single batch.  Sectors already cached are left alone.  If the batch fails, the
+ *   entries it was meant to fill are left empty.
+ * RETURN
+ *   0 for NO ERROR, nonzero if writing back dirty sectors or the reads failed
+ */
+int tf_cache_prefetch(TFCache *cache, uint32_t sector, uint32_t count) {
+    TFIOVec iov[TF_READAHEAD_MAX];
+    TFCacheEntry *claimed[TF_READAHEAD_MAX];
+    TFBlockRequest batch[TF_BATCH];
+    TFCacheEntry *e;
+    uint32_t i;
+    int n=0, iovcnt=0, rc=0;
+
+    // Keep to half the cache, so the run can't evict its own sectors
+    if(count > cache->sets*cache->ways/2) count = cache->sets*cache->ways/2;
+    if(count > TF_READAHEAD_MAX) count = TF_READAHEAD_MAX;
+    for(i=0; i<count; i++, sector++) {
+        e = tf_cache_lookup(cache, sector);
+        if(e->sector == sector) continue;
+        if(n == TF_BATCH && sector != batch[n-1].sector + batch[n-1].iovcnt) break;
+        rc |= tf_cache_claim(cache, e, sector);
+
+        // Sectors that follow the last request extend it, others start a new one
+        if(n > 0 && sector == batch[n-1].sector + batch[n-1].iovcnt) {
+            batch[n-1].iovcnt++;
+        }
+        else {
+            batch[n].iov = &iov[iovcnt];
+            batch[n].iovcnt = 1;
+            batch[n].sector = sector;
+            batch[n].write = 0;
+            n++;
+        }
+        iov[iovcnt].data = e->data;
+        iov[iovcnt].count = 1;
+        claimed[iovcnt++] = e;
+    }
+    if(n == 0) return rc;
+
+    dbg_printf("\r\n[DEBUG-tf_cache_prefetch] Reading %d sectors ahead from (%d).", iovcnt, batch[0].sector);
+    #ifdef TF_DEBUG
+    tf_stats.sector_reads += iovcnt;
+    #endif
+    cache->misses += iovcnt;
+    if(transfer_sectors(batch, n)) {
+        for(i=0; i<(uint32_t)iovcnt; i++) claimed[i]->sector = TF_CACHE_EMPTY;
+        rc |= 1;
+    }
+    return rc;
+}
+
+/*
+ * Write a cached sector back to disk
+ * ARGS
+ *   entry - the entry to write
+ * SIDE EFFECTS
+ *   The entry is no longer dirty
+ * RETURN
+ *   the error code given by the users write_sector() (should be zero for NO ERROR, nonzero otherwise)
+ */
+int tf_cache_store(TFCacheEntry *entry) {
+    entry->flags &= ~TF_FLAG_DIRTY;
+    if(entry->sector == TF_CACHE_EMPTY) return 0;
+    dbg_printf("\r\n[DEBUG-tf_cache_store] Writing sector (%d) to disk.", entry->sector);
+    #ifdef TF_DEBUG
+    tf_stats.sector_writes += 1;
+    #endif
+    return write_sector(entry->data, entry->sector);
+}
+
+/*
+ * Hand a batch of write requests for a cache's sectors to the device
+ * ARGS
+ *   cache - the cache the sectors belong to
+ *   batch - the requests
+ *   count - number of requests
+ * SIDE EFFECTS
+ *   Sectors of tf_info.fatCache are FAT sectors of the first FAT in use: the same batch is then
+ *   handed over again for each other copy of the FAT (see tf_info.fatCopies), moved along by
+ *   the size of a FAT.  The requests' sector numbers are changed.
+ * RETURN
+ *   0 for NO ERROR, nonzero if any of the writes failed
+ */
+int tf_cache_submit(TFCache *cache, TFBlockRequest *batch, int count) {
+    int i, copy, rc;
+
+    rc = transfer_sectors(batch, count);
+    if(cache != &tf_info.fatCache) return rc;
+    for(copy=1; copy<tf_info.fatCopies; copy++) {
+        for(i=0; i<count; i++) {
+            batch[i].sector += tf_info.fatSize;
+            #ifdef TF_DEBUG
+            tf_stats.sector_writes += batch[i].iovcnt;
+            #endif
+        }
+        dbg_printf("\r\n[DEBUG-tf_cache_submit] Mirroring %d requests to FAT %d.", count, copy);
+        rc |= transfer_sectors(batch, count);
+    }
+    return rc;
+}
+
+/*
+ * Write every dirty sector of a cache back to disk
+ * ARGS
+ *   cache - the cache to flush
+ * SIDE EFFECTS
+ *   The dirty sectors are written in ascending order, runs of consecutive sectors as a single
+ *   request, and up to TF_BATCH requests (TF_CACHE_FLUSH_IOV sectors) are handed to the device
+ *   at once.  Nothing in the cache is dirty anymore, except sectors of clusters whose
+ *   allocation is delayed (see tf_delay_cluster()), which have nowhere to go yet.  The sectors
+ *   stay cached.  The sectors of tf_info.fatCache go to every copy of the FAT (see
+ *   tf_cache_submit()).
+ * RETURN
+ *   0 for NO ERROR, nonzero if any of the writes failed
+ */
+int tf_cache_flush(TFCache *cache) {
+    TFIOVec iov[TF_CACHE_FLUSH_IOV];
+    TFBlockRequest batch[TF_BATCH];
+    TFCacheEntry *e, *lowest;
+    uint32_t i, runEnd=0;
+    int n=0, iovcnt=0, rc=0;
+
+    for(;;) {
+        // Pick the lowest dirty sector left; the ones below it are already queued
+        lowest = NULL;
+        for(i=0, e=cache->entries; i<cache->sets*cache->ways; i++, e++) {
+            if(!(e->flags & TF_FLAG_DIRTY)) continue;
+            if(e->sector == TF_CACHE_EMPTY) e->flags &= ~TF_FLAG_DIRTY;
+            else if(cache == &tf_info.cache && tf_delay_sector(e->sector)) continue;
+            else if(lowest == NULL || e->sector < lowest->sector) lowest = e;
+        }
+        if(lowest == NULL) break;
+        lowest->flags &= ~TF_FLAG_DIRTY;
+
+        // Extend the last request if the sector follows it, otherwise start a new one
+        if(n > 0 && lowest->sector == runEnd && iovcnt < TF_CACHE_FLUSH_IOV) {
+            batch[n-1].iovcnt++;
+        }
+        else {
+            if(n == TF_BATCH || iovcnt == TF_CACHE_FLUSH_IOV) {
+                rc |= tf_cache_submit(cache, batch, n);
+                n = iovcnt = 0;
+            }
+            batch[n].iov = &iov[iovcnt];
+            batch[n].iovcnt = 1;
+            batch[n].sector = lowest->sector;
+            batch[n].write = 1;
+            n++;
+        }
+        dbg_printf("\r\n[DEBUG-tf_cache_flush] Writing sector (%d) to disk.", lowest->sector);
+        #ifdef TF_DEBUG
+        tf_stats.sector_writes += 1;
+        #endif
+        iov[iovcnt].data = lowest->data;
+        iov[iovcnt].count = 1;
+        iovcnt++;
+        runEnd = lowest->sector + 1;
+    }
+    if(n > 0) rc |= tf_cache_submit(cache, batch, n);
+    return rc;
+}
+
+/*
+ * Write everything the caches hold back to disk
+ * SIDE EFFECTS
+ *   Delayed clusters are allocated, the FSInfo sector is brought up to date, every dirty sector of tf_info.cache and
+ *   tf_info.fatCache (and the current sector, if mapped and dirty) is written, and the device is
+ *   asked to flush() what it buffers.
+ * RETURN
+ *   0 for NO ERROR, nonzero if any of the writes failed
+ */
+int tf_sync(void) {
+    int rc;
+    dbg_printf("\r\n[DEBUG-tf_sync] Writing back dirty sectors... ");
+    rc = tf_delay_commit_all();
+    rc |= tf_fsinfo_store();
+    rc |= tf_cache_flush(&tf_info.cache);
+    rc |= tf_cache_flush(&tf_info.fatCache);
+    if(tf_info.mapped.flags & TF_FLAG_DIRTY) {
+        rc |= tf_cache_store(&tf_info.mapped);
+    }
+    rc |= flush_device();
+    return rc;
+}
+
+/*
+ * Copy the dirty sectors a cache holds for a run over a copy of the run read from disk
+ * ARGS
+ *   cache - the cache to look in
+ *   dest - the run as read from disk, count*512 bytes
+ *   sector - the first sector of the run
+ *   count - number of sectors in the run
+ */
+void tf_cache_overlay(TFCache *cache, uint8_t *dest, uint32_t sector, uint32_t count) {
+    TFCacheEntry *e;
+    uint32_t i;
+    for(i=0, e=cache->entries; i<cache->sets*cache->ways; i++, e++) {
+        if((e->flags & TF_FLAG_DIRTY) && e->sector - sector < count) {
+            memcpy(dest + (e->sector - sector)*512, e->data, 512);
+        }
+    }
+}
+
+/*
+ * Bring the sectors a cache holds for a run up to date with new contents written to disk
+ * ARGS
+ *   cache - the cache to update
+ *   src - the new contents of the run, count*512 bytes
+ *   sector - the first sector of the run
+ *   count - number of sectors in the run
+ * SIDE EFFECTS
+ *   The updated entries are no longer dirty
+ */
+void tf_cache_update(TFCache *cache, uint8_t *src, uint32_t sector, uint32_t count) {
+    TFCacheEntry *e;
+    uint32_t i;
+    for(i=0, e=cache->entries; i<cache->sets*cache->ways; i++, e++) {
+        if(e->sector - sector < count) {
+            memcpy(e->data, src + (e->sector - sector)*512, 512);
+            e->flags &= ~TF_FLAG_DIRTY;
+        }
+    }
+}
+
 /*
  * Fetch a single sector from disk.
  * ARGS
  *   sector - the sector number to fetch.
  * SIDE EFFECTS
- *   tf_info.buffer contains the 512 byte sector requested
+ *   tf_info.buffer contains the 512 byte sector requested, and tf_info.current is the cache
+ *   entry holding it: set TF_FLAG_DIRTY in tf_info.current->flags after modifying the buffer.
+ *   Sectors are served from tf_info.cache when possible; a miss may write back another, dirty,
+ *   sector of the cache.  On devices that can map their media the buffer points straight at
+ *   the device's copy of the sector, nothing is read or copied and the cache is not used.
  *   tf_info.currentSector contains the sector number retrieved
- *   if tf_info.buffer already contained a fetched sector, and was marked dirty, that sector is
- *   tf_store()d back to its appropriate location before executing the fetch.
  * RETURN
  *   the return code given by the users read_sector() (should be zero for NO ERROR, nonzero otherwise)
  */
 int tf_fetch(uint32_t sector) {
     int rc=0;
+    uint8_t *mapped;
+    TFCacheEntry *entry;
     // Don't actually do the fetch if we already have it in memory
     if(sector == tf_info.currentSector) 
     {
         return 0;
     }
     
-    // If the sector we already have prefetched is dirty, write it before reading out the new one
-    if(tf_info.sectorFlags & TF_FLAG_DIRTY) {
-        rc |= tf_store();
-        
-        dbg_printf("\r\n[DEBUG-tf_fetch] Current sector (%d) dirty... storing to disk.", tf_info.currentSector);
-        #ifdef TF_DEBUG
-        tf_stats.sector_writes += 1;
-        #endif
+    // A mapped sector is only held while it is the current one, so hand it back now if dirty
+    if(tf_info.mapped.flags & TF_FLAG_DIRTY) {
+        rc |= tf_cache_store(&tf_info.mapped);
     }
     
-    dbg_printf("\r\n[DEBUG-tf_fetch] Fetching sector (%d) from disk.", sector);
-    #ifdef TF_DEBUG
-    tf_stats.sector_reads += 1;
-    #endif
-    // Do the read, pass up the error flag
-    rc |= read_sector( tf_info.buffer, sector );
-    if(!rc) tf_info.currentSector = sector;
+    // Zero-copy devices hand us their own copy of the sector
+    if(tf_info.dev->map && (mapped = tf_info.dev->map(tf_info.dev->ctx, sector)) != NULL) {
+        tf_info.mapped.sector = sector;
+        tf_info.mapped.data = mapped;
+        tf_info.current = &tf_info.mapped;
+        tf_info.buffer = mapped;
+        tf_info.currentSector = sector;
+        return rc;
+    }
+    
+    rc |= tf_cache_fetch(&tf_info.cache, sector, &entry);
+    tf_info.current = entry;
+    tf_info.buffer = entry->data;
+    tf_info.currentSector = entry->sector;
+    return rc;
+}
+
+/*
+ * Make a sector current without reading it, for callers about to overwrite all of it that matters
+ * ARGS
+ *   sector - the sector number to make current
+ * SIDE EFFECTS
+ *   Same as tf_fetch(), except that a sector that isn't cached already is not read from disk:
+ *   its cache entry is zero filled instead.
+ * RETURN
+ *   0 for NO ERROR, nonzero if writing back dirty sectors to make room failed
+ */
+int tf_fetch_blank(uint32_t sector) {
+    TFCacheEntry *entry;
+    int rc=0;
+    if(sector == tf_info.currentSector) return 0;
+    // Mapping costs nothing, there is no read to save.  And a sector outside the volume (a
+    // corrupt cluster chain) must fail like a read would, rather than become a dirty entry,
+    // unless it belongs to a cluster whose allocation is delayed.
+    if(tf_info.dev->map || (sector >= tf_info.totalSectors && !tf_delay_sector(sector))) return tf_fetch(sector);
+
+    entry = tf_cache_lookup(&tf_info.cache, sector);
+    if(entry->sector == sector) {
+        entry->lastUse = ++tf_info.cache.clock;
+        tf_info.cache.hits += 1;
+    }
+    else {
+        dbg_printf("\r\n[DEBUG-tf_fetch_blank] Sector (%d) will be overwritten, not reading it.", sector);
+        rc = tf_cache_claim(&tf_info.cache, entry, sector);
+        memset(entry->data, 0, 512);
+    }
+    tf_info.current = entry;
+    tf_info.buffer = entry->data;
+    tf_info.currentSector = sector;
     return rc;
 }
 
@@ -77,34 +562,100 @@ int tf_fetch(uint32_t sector) {
  * Store the current sector back to disk
  * SIDE EFFECTS
  *   512 bytes of tf_info.buffer are stored on disk in the sector specified by tf_info.currentSector
+ *   and the current cache entry is no longer dirty
  * RETURN
  *   the error code given by the users write_sector() (should be zero for NO ERROR, nonzero otherwise)
  */
 int tf_store() {
-    dbg_printf("\r\n[DEBUG-tf_store] Writing sector (%d) to disk.", tf_info.currentSector);
-    tf_info.sectorFlags &= ~TF_FLAG_DIRTY;
-    return write_sector( tf_info.buffer, tf_info.currentSector );
+    return tf_cache_store(tf_info.current);
+}
+
+/*
+ * Read a run of consecutive sectors straight into dest, bypassing the sector cache
+ * ARGS
+ *   dest - destination, at least count*512 bytes
+ *   sector - the first sector of the run
+ *   count - number of sectors in the run
+ * SIDE EFFECTS
+ *   Sectors of the run that are dirty in tf_info.cache or tf_info.fatCache have their cached
+ *   contents copied to dest
+ * RETURN
+ *   the return code given by read_sectors()
+ */
+int tf_fetch_run(uint8_t *dest, uint32_t sector, uint32_t count) {
+    int rc;
+    dbg_printf("\r\n[DEBUG-tf_fetch_run] Fetching sectors (%d-%d) from disk.", sector, sector+count-1);
+    #ifdef TF_DEBUG
+    tf_stats.sector_reads += count;
+    #endif
+    rc = read_sectors(dest, sector, count);
+    tf_cache_overlay(&tf_info.cache, dest, sector, count);
+    tf_cache_overlay(&tf_info.fatCache, dest, sector, count);
+    return rc;
+}
+
+/*
+ * Write a run of consecutive sectors straight from src, bypassing the sector cache
+ * ARGS
+ *   src - source data, count*512 bytes
+ *   sector - the first sector of the run
+ *   count - number of sectors in the run
+ * SIDE EFFECTS
+ *   Sectors of the run held in tf_info.cache or tf_info.fatCache are updated with the new
+ *   contents and are no longer dirty
+ * RETURN
+ *   the return code given by write_sectors()
+ */
+int tf_store_run(uint8_t *src, uint32_t sector, uint32_t count) {
+    dbg_printf("\r\n[DEBUG-tf_store_run] Writing sectors (%d-%d) to disk.", sector, sector+count-1);
+    #ifdef TF_DEBUG
+    tf_stats.sector_writes += count;
+    #endif
+    tf_cache_update(&tf_info.cache, src, sector, count);
+    tf_cache_update(&tf_info.fatCache, src, sector, count);
+    return write_sectors(src, sector, count);
 }
 
 /*
  * Initialize the filesystem
  * Reads filesystem info from disk into tf_info and checks that info for validity
+ * ARGS
+ *   dev - the block device holding the filesystem.  It stays registered (and is used by
+ *         tf_initializeMedia() too) until the next call to tf_init().  Passing NULL re-mounts
+ *         the device that is already registered.
  * SIDE EFFECTS
  *   Sector 0 is fetched into tf_info.buffer
  *   If TF_DEBUG is specified tf_stats is initialized
  * RETURN
  *   0 for a successfully initialized filesystem, nonzero otherwise.
  */
-int tf_init() {
+int tf_init(TFBlockDevice *dev) {
     BPB_struct *bpb;
-    uint32_t fat_size, root_dir_sectors, data_sectors, cluster_count, temp;
-    TFFile *fp;
-    FatFileEntry e;
+    uint32_t fat_size, root_dir_sectors, data_sectors, cluster_count;
+
+    if(dev != NULL) tf_info.dev = dev;
+    if(tf_info.dev == NULL) {
+        dbg_printf("  tf_init() FAILED: no block device registered\r\n");
+        return TF_ERR_NO_DEVICE;
+    }
 
     // Initialize the runtime portion of the TFInfo structure, and read sec0
-    tf_info.currentSector = -1;
-    tf_info.sectorFlags = 0;
-    tf_fetch(0);
+    tf_cache_init(&tf_info.cache, tf_cache_entries, &tf_cache_data[0][0], TF_CACHE_SETS, TF_CACHE_WAYS);
+    tf_info.cache.dirtyLimit = TF_CACHE_DIRTY_LIMIT;
+    tf_cache_init(&tf_info.fatCache, tf_fat_cache_entries, &tf_fat_cache_data[0][0], TF_FAT_CACHE_SETS, TF_FAT_CACHE_WAYS);
+    tf_info.mapped.sector = TF_CACHE_EMPTY;
+    tf_info.mapped.flags = 0;
+    tf_info.currentSector = TF_CACHE_EMPTY;
+    tf_info.delayBase = 0;
+    tf_info.delayedClusters = 0;
+    tf_info.dentryClock = 0;
+    tf_dentry_invalidate(0);
+    tf_info.dirIndexClock = 0;
+    tf_dir_index_drop(0);
+    if(tf_fetch(0)) {
+        dbg_printf("  tf_init() FAILED: could not read sector 0\r\n");
+        return TF_ERR_IO;
+    }
 
     // Cast to a BPB, so we can extract relevant data
     bpb = (BPB_struct *) tf_info.buffer;
@@ -147,8 +698,22 @@ int tf_init() {
     data_sectors              = tf_info.totalSectors - (bpb->ReservedSectorCount + (bpb->NumFATs * fat_size) + root_dir_sectors);
     tf_info.sectorsPerCluster = bpb->SectorsPerCluster;
     cluster_count             = data_sectors/tf_info.sectorsPerCluster;
+    tf_info.totalClusters     = cluster_count + 2;    // clusters 0 and 1 are reserved
     tf_info.reservedSectors   = bpb->ReservedSectorCount;
     tf_info.firstDataSector    = bpb->ReservedSectorCount + (bpb->NumFATs * fat_size) + root_dir_sectors;
+    tf_info.fsinfoSector      = bpb->FSTypeSpecificData.fat32.FSInfo;
+    tf_info.fatSize           = fat_size;
+
+    // With mirroring on (ExtFlags bit 7 clear) every FAT gets each update, otherwise only the
+    // active FAT (bits 0-3) is used
+    if((bpb->FSTypeSpecificData.fat32.ExtFlags & 0x80) && (bpb->FSTypeSpecificData.fat32.ExtFlags & 0x0f) < bpb->NumFATs) {
+        tf_info.fatStart  = bpb->ReservedSectorCount + (bpb->FSTypeSpecificData.fat32.ExtFlags & 0x0f) * fat_size;
+        tf_info.fatCopies = 1;
+    }
+    else {
+        tf_info.fatStart  = bpb->ReservedSectorCount;
+        tf_info.fatCopies = bpb->NumFATs ? bpb->NumFATs : 1;
+    }
     
     // Now that we know the total count of clusters, we can compute the FAT type
     if(cluster_count < 65525)
@@ -158,32 +723,32 @@ int tf_init() {
     }
     else tf_info.type = TF_TYPE_FAT32;
 
+    // Placeholders for delayed clusters are numbered past the last cluster, where neither their
+    // cluster nor their sector numbers can be mistaken for anything else.  Devices that map their
+    // media have no cache to keep the placeholders' sectors in.
+    if(!tf_info.dev->map && (uint64_t)(tf_info.totalClusters + 1 + TF_FILE_HANDLES*TF_DELAY_CLUSTERS - 2) *
+       tf_info.sectorsPerCluster + tf_info.firstDataSector < TF_CACHE_EMPTY &&
+       tf_info.totalClusters + 1 + TF_FILE_HANDLES*TF_DELAY_CLUSTERS < TF_MARK_BAD_CLUSTER32) {
+        tf_info.delayBase = tf_info.totalClusters + 1;
+    }
+
     #ifdef TF_DEBUG
     tf_stats.sector_reads = 0;
     tf_stats.sector_writes = 0;
     #endif
 
-    // TODO ADD SANITY CHECKING HERE (CHECK THE BOOT SIGNATURE, ETC... ETC...)
-    tf_info.rootDirectorySize = 0xffffffff;
-    temp = 0;
+    // Pick up the free cluster hints left by whoever wrote the volume last.  Mounting reads
+    // nothing else: which clusters are free is only learned once something has to be allocated
+    // (see tf_freemap_ready()), so the time it takes doesn't depend on what the volume holds.
+    tf_fsinfo_load();
+    tf_info.freemapReady = 0;
+    tf_info.freemapPending = 1;
 
-    // Like recording the root directory size!
-    // TODO, THis probably isn't necessary.  Remove later
-    fp = tf_fopen("/", "r");
-    do {
-        temp += sizeof(FatFileEntry);
-        tf_fread((uint8_t*)&e, sizeof(FatFileEntry), fp);
-    } while(e.msdos.filename[0] != '\x00');
-    tf_fclose(fp);
-    tf_info.rootDirectorySize = temp;
-    
-    dbg_printf("\r\n[DEBUG-tf_init] Size of root directory: %d bytes", tf_info.rootDirectorySize);
+    // TODO ADD SANITY CHECKING HERE (CHECK THE BOOT SIGNATURE, ETC... ETC...)
     #ifdef TF_DEBUG
     tf_fetch(0);
     printBPB( (BPB_struct*)tf_info.buffer );
     #endif
-    tf_fclose(fp);
-    tf_release_handle(fp);
     dbg_printf("\r\ntf_init() successful...\r\n");
     return 0;    
 }
@@ -193,16 +758,18 @@ int tf_init() {
  * ARGS
  *   cluster - The cluster number for the requested FAT entry
  * SIDE EFFECTS
- *   Retreives whatever sector happens to contain that FAT entry (if it's not already in memory)
+ *   Retreives whatever sector happens to contain that FAT entry into tf_info.fatCache (if it's not
+ *   already there).  tf_info.buffer is left alone.
  * RETURN
  *   The value of the fat entry for the specified cluster.
  */
 uint32_t tf_get_fat_entry(uint32_t cluster) {
+    TFCacheEntry *entry;
     tf_printf("\r\n        [DEBUG-tf_get_fat_entry] %x ", cluster);
     uint32_t offset=cluster*4;
-    tf_fetch(tf_info.reservedSectors + (offset/512)); // 512 is hardcoded bpb->bytesPerSector
+    tf_cache_fetch(&tf_info.fatCache, tf_info.fatStart + (offset/512), &entry); // 512 is hardcoded bpb->bytesPerSector
     tf_printf("\r\n        [DEBUG-tf_get_fat_entry] done");
-    return *((uint32_t *) &(tf_info.buffer[offset % 512]));
+    return *((uint32_t *) &(entry->data[offset % 512]));
 }
 
 /*
@@ -211,21 +778,31 @@ uint32_t tf_get_fat_entry(uint32_t cluster) {
  *   cluster - The cluster number for which to set the FAT entry
  *     value - The new value for the FAT entry  
  * SIDE EFFECTS
- *   Fetches whatever sector happens to contain the pertinent fat entry (if it's not already in memory)
+ *   Fetches whatever sector happens to contain the pertinent fat entry into tf_info.fatCache (if
+ *   it's not already there) and marks it dirty if the entry changes.  The free cluster bitmap,
+ *   free cluster count and next free hint follow the change.
  * RETURN
  *   0 for no error, or nonzero for error with fetch
- * TODO
- *   Does the sector modified here need to be flagged as dirty?
  */
 int tf_set_fat_entry(uint32_t cluster, uint32_t value) {
-    uint32_t offset;
-    int rc;
+    TFCacheEntry *entry;
+    uint32_t offset, old;
+    int rc, used;
     tf_printf("\r\n        [DEBUG-tf_set_fat_entry] %x  %x ", cluster, value);
     offset=cluster*4; // FAT32
-    rc = tf_fetch(tf_info.reservedSectors + (offset/512)); // 512 is hardcoded bpb->bytesPerSector
-    if (*((uint32_t *) &(tf_info.buffer[offset % 512])) != value) {
-        tf_info.sectorFlags |= TF_FLAG_DIRTY; // Mark this sector as dirty
-        *((uint32_t *) &(tf_info.buffer[offset % 512])) = value;
+    rc = tf_cache_fetch(&tf_info.fatCache, tf_info.fatStart + (offset/512), &entry); // 512 is hardcoded bpb->bytesPerSector
+    old = *((uint32_t *) &(entry->data[offset % 512]));
+    if (old != value) {
+        entry->flags |= TF_FLAG_DIRTY; // Mark this sector as dirty
+        *((uint32_t *) &(entry->data[offset % 512])) = value;
+        // Keep the free space bookkeeping up to date when a cluster is allocated or freed
+        used = (value & 0x0fffffff) != 0;
+        if(((old & 0x0fffffff) != 0) != used) {
+            if(tf_info.freemapReady) tf_freemap_set(cluster, used);
+            if(tf_info.freeCount != TF_FREE_UNKNOWN) tf_info.freeCount += used ? -1 : 1;
+            if(used) tf_info.nextFree = cluster + 1;
+            tf_info.fsinfoDirty = 1;
+        }
     }
     tf_printf("\r\n        [DEBUG-tf_set_fat_entry] done");
     return rc;
@@ -262,6 +839,9 @@ uint32_t tf_first_sector(uint32_t cluster) {
  */
 uint8_t *tf_walk(uint8_t *filename, TFFile *fp) {
     FatFileEntry entry;
+    TFDentry *dentry;
+    uint32_t pos=0, sector=0;
+    int length;
     tf_printf("\r\n  [DEBUG-tf_walk] Walking path '%s'", filename);
     
     // We're out of path. this walk is COMPLETE
@@ -273,30 +853,49 @@ uint8_t *tf_walk(uint8_t *filename, TFFile *fp) {
     if(*filename != '\x00') {
         // fp is the handle for the current directory
         // filename is the name of the current file in that directory
-        // Go fetch the FatFileEntry that corresponds to the current file
-        // Remember that tf_find_file is only going to search from the beginning of the filename
-        // up until the first path separation character
-        if(tf_find_file(fp, filename)) {
-            // This happens when we couldn't actually find the file
-            fp->flags = 0xff;
-            dbg_printf("\r\n  [DEBUG-tf_walk] Exiting - not found");
-            return NULL;
+        for(length=0; (filename[length] != '/') && (filename[length] != '\x00'); length++);
+        // The directory entry cache may know it already, otherwise go fetch the FatFileEntry that
+        // corresponds to the current file.  Remember that tf_find_file is only going to search
+        // from the beginning of the filename up until the first path separation character
+        dentry = tf_dentry_lookup(fp->startCluster, filename, length);
+        if(dentry == NULL) {
+            if(tf_find_file(fp, filename)) {
+                // This happens when we couldn't actually find the file
+                fp->flags = 0xff;
+                dbg_printf("\r\n  [DEBUG-tf_walk] Exiting - not found");
+                return NULL;
+            }
+            pos = fp->pos;
+            sector = tf_first_sector(fp->currentCluster) + fp->currentByte/512;
+            tf_fread((uint8_t*)&entry, sizeof(FatFileEntry), fp);
         }
-        tf_fread((uint8_t*)&entry, sizeof(FatFileEntry), fp);
-        // Walk over path separators
-        while((*filename != '/') && (*filename != '\x00')) filename+=1;
-        if(*filename == '/') filename +=1 ;
         // Set up the file pointer now that we've got information for the next level in the path hierarchy
         fp->parentStartCluster = fp->startCluster;
-        fp->startCluster = ((uint32_t)(entry.msdos.eaIndex & 0xffff) << 16) | (entry.msdos.firstCluster & 0xffff);
-        fp->attributes = entry.msdos.attributes;
-               fp->currentCluster = fp->startCluster;
+        if(dentry) {
+            fp->startCluster = dentry->startCluster;
+            fp->attributes = dentry->attributes;
+            fp->size = dentry->size;
+            fp->direntPos = dentry->entryPos;
+            fp->direntSector = dentry->entrySector;
+        }
+        else {
+            fp->startCluster = ((uint32_t)(entry.msdos.eaIndex & 0xffff) << 16) | (entry.msdos.firstCluster & 0xffff);
+            fp->attributes = entry.msdos.attributes;
+            fp->size = (entry.msdos.attributes & TF_ATTR_DIRECTORY) ? 0xffffffff : entry.msdos.fileSize;
+            fp->direntPos = pos;
+            fp->direntSector = sector;
+            tf_dentry_insert(fp->parentStartCluster, filename, length, fp);
+        }
+        // Walk over path separators
+        filename += length;
+        if(*filename == '/') filename +=1 ;
+        fp->currentCluster = fp->startCluster;
         fp->currentClusterIdx=0;
         fp->currentSector=0;
         fp->currentByte=0;
         fp->pos=0;
         fp->flags=TF_FLAG_OPEN;
-        fp->size=(entry.msdos.attributes & TF_ATTR_DIRECTORY) ? 0xffffffff :entry.msdos.fileSize;
+        tf_extent_reset(fp);
         if(*filename == '\x00') return NULL;
         tf_printf("\r\n  [DEBUG-tf_walk] Done: '%s'  (fp->startCluster=%x", filename, fp->startCluster);
         return filename;
@@ -305,31 +904,140 @@ uint8_t *tf_walk(uint8_t *filename, TFFile *fp) {
     return NULL;
 }
 
-TFFile *tf_get_free_handle();
 /*
- * Searches the list of system file handles for a free one, and returns it.
+ * Hash a name in a directory for the directory entry cache, without regard to case
+ */
+uint32_t tf_dentry_hash(uint32_t dir, uint8_t *name, int length) {
+    uint32_t hash = 2166136261u ^ dir;
+    int i;
+    for(i=0; i<length; i++) hash = (hash ^ upper(name[i])) * 16777619u;
+    return hash ^ (hash >> 16);
+}
+
+/*
+ * Find a directory entry in the directory entry cache
+ * ARGS
+ *   dir - the first cluster of the directory the entry is in
+ *   name - the name to look for (not terminated)
+ *   length - the length of the name
  * RETURN
- *   NULL if no system file handles are free, or the free handle if one is available.
+ *   the cached entry, or NULL if the cache doesn't hold it (names longer than TF_DENTRY_NAME
+ *   are never cached)
  */
-TFFile *tf_get_free_handle() {
+TFDentry *tf_dentry_lookup(uint32_t dir, uint8_t *name, int length) {
+    TFDentry *d;
+    uint32_t hash;
     int i;
-    TFFile *fp;
-    for(i=0; i<TF_FILE_HANDLES; i++) {
-        fp = &tf_file_handles[i];
-        if(fp->flags & TF_FLAG_OPEN) continue;
-        // We get here if we find a free handle
-        fp->flags = TF_FLAG_OPEN;
-        return fp;
+
+    if(length > TF_DENTRY_NAME) return NULL;
+    hash = tf_dentry_hash(dir, name, length);
+    d = &tf_dentries[(hash & (TF_DENTRY_SETS-1)) * TF_DENTRY_WAYS];
+    for(i=0; i<TF_DENTRY_WAYS; i++, d++) {
+        if(d->dirCluster == dir && d->nameLength == length && !strncasecmp((char *)d->name, (char *)name, length)) {
+            d->lastUse = ++tf_info.dentryClock;
+            tf_printf("\r\n  [DEBUG-tf_dentry_lookup] Hit: '%.*s' in %x", length, name, dir);
+            return d;
+        }
     }
     return NULL;
 }
 
 /*
- * Release a filesystem handle (mark as available)
+ * Remember a directory entry in the directory entry cache
+ * ARGS
+ *   dir - the first cluster of the directory the entry is in
+ *   name - the name it was found by (not terminated)
+ *   length - the length of the name
+ *   fp - a handle set up for the entry by tf_walk(): its start cluster, attributes, size and
+ *        the location of its 8.3 record are kept
+ * SIDE EFFECTS
+ *   The least recently used entry of the set the name hashes to is replaced
  */
-void tf_release_handle(TFFile *fp) {
-    fp->flags &= ~TF_FLAG_OPEN;
-}
+void tf_dentry_insert(uint32_t dir, uint8_t *name, int length, TFFile *fp) {
+    TFDentry *d, *victim;
+    int i;
+
+    if(length > TF_DENTRY_NAME || dir == 0) return;
+    d = &tf_dentries[(tf_dentry_hash(dir, name, length) & (TF_DENTRY_SETS-1)) * TF_DENTRY_WAYS];
+    for(i=0, victim=d; i<TF_DENTRY_WAYS; i++, d++) {
+        if(d->dirCluster == 0) { victim = d; break; }
+        if(d->lastUse < victim->lastUse) victim = d;
+    }
+    victim->dirCluster = dir;
+    victim->entryPos = fp->direntPos;
+    victim->entrySector = fp->direntSector;
+    victim->startCluster = fp->startCluster;
+    victim->size = fp->size;
+    victim->attributes = fp->attributes;
+    victim->nameLength = length;
+    memcpy(victim->name, name, length);
+    victim->lastUse = ++tf_info.dentryClock;
+}
+
+/*
+ * Bring the cached copies of a directory entry up to date with a new file size
+ * ARGS
+ *   dir - the first cluster of the directory the entry is in
+ *   pos - the offset of the entry's 8.3 record in the directory
+ *   size - the size written to the entry
+ */
+void tf_dentry_update(uint32_t dir, uint32_t pos, uint32_t size) {
+    int i;
+    for(i=0; i<TF_DENTRY_SETS*TF_DENTRY_WAYS; i++) {
+        if(tf_dentries[i].dirCluster == dir && tf_dentries[i].entryPos == pos) tf_dentries[i].size = size;
+    }
+}
+
+/*
+ * Forget the cached copies of a directory entry that was removed
+ * ARGS
+ *   dir - the first cluster of the directory the entry was in
+ *   pos - the offset of the entry's 8.3 record in that directory
+ */
+void tf_dentry_forget(uint32_t dir, uint32_t pos) {
+    int i;
+    for(i=0; i<TF_DENTRY_SETS*TF_DENTRY_WAYS; i++) {
+        if(tf_dentries[i].dirCluster == dir && tf_dentries[i].entryPos == pos) tf_dentries[i].dirCluster = 0;
+    }
+}
+
+/*
+ * Forget every cached entry of a directory
+ * ARGS
+ *   dir - the first cluster of the directory, 0 to empty the whole cache
+ */
+void tf_dentry_invalidate(uint32_t dir) {
+    int i;
+    for(i=0; i<TF_DENTRY_SETS*TF_DENTRY_WAYS; i++) {
+        if(dir == 0 || tf_dentries[i].dirCluster == dir) tf_dentries[i].dirCluster = 0;
+    }
+}
+
+TFFile *tf_get_free_handle();
+/*
+ * Searches the list of system file handles for a free one, and returns it.
+ * RETURN
+ *   NULL if no system file handles are free, or the free handle if one is available.
+ */
+TFFile *tf_get_free_handle() {
+    int i;
+    TFFile *fp;
+    for(i=0; i<TF_FILE_HANDLES; i++) {
+        fp = &tf_file_handles[i];
+        if(fp->flags & TF_FLAG_OPEN) continue;
+        // We get here if we find a free handle
+        fp->flags = TF_FLAG_OPEN;
+        return fp;
+    }
+    return NULL;
+}
+
+/*
+ * Release a filesystem handle (mark as available)
+ */
+void tf_release_handle(TFFile *fp) {
+    fp->flags &= ~TF_FLAG_OPEN;
+}
 
 // Convert a character to uppercase
 // TODO: Re-do how filename conversions are done.
@@ -642,20 +1350,23 @@ int tf_place_lfn_chain(TFFile *fp, uint8_t *filename, uint8_t *sfn) {
 int tf_create(uint8_t *filename) {
     TFFile *fp = tf_parent(filename, "r", false);
     FatFileEntry entry;
-    uint32_t cluster;
+    uint32_t cluster, record;
     uint8_t *temp;    
+    int reuse;
     dbg_printf("\r\n[DEBUG-tf_create] Creating new file: '%s'", filename);
     if(!fp) return 1;
     tf_fclose(fp);
     fp = tf_parent(filename, "r+", false);
+    temp = strrchr(filename, '/')+1;
+    dbg_printf("\r\n[DEBUG-tf_create] FILENAME CONVERSION: %s", temp);
+    // Choosing the 8.3 name indexes the directory, so it goes first (tf_shorten_filename() looks
+    // at what the name held before, which used to be the terminating record the scan stopped on)
+    memset(&entry, 0, sizeof(FatFileEntry));
+    tf_choose_sfn(entry.msdos.filename, temp, fp);
+    tf_printf("\r\n==== tf_create: SFN: %s", entry.msdos.filename);
     // Now we have the directory in which we want to create the file, open for overwrite
-    do {
-        //"seek" to the end
-        tf_fread((uint8_t*)&entry, sizeof(FatFileEntry), fp);
-        tf_printf("Skipping existing directory entry... %d\r\n", fp->pos);
-    } while(entry.msdos.filename[0] != '\x00');
-    // Back up one entry, this is where we put the new filename entry
-    tf_fseek(fp, -sizeof(FatFileEntry), fp->pos);
+    reuse = tf_dir_seek_free(fp, (strlen((char *)temp)+LFN_ENTRY_CAPACITY-1)/LFN_ENTRY_CAPACITY + 1);
+    record = fp->pos / sizeof(FatFileEntry);
     cluster = tf_find_free_cluster();
     tf_set_fat_entry(cluster, TF_MARK_EOC32); // Marks the new cluster as the last one (but no longer free)
     // TODO shorten these entries with memset
@@ -669,18 +1380,17 @@ int tf_create(uint8_t *filename) {
     entry.msdos.modifiedDate = 0x4262;
     entry.msdos.firstCluster = cluster & 0xffff;
     entry.msdos.fileSize = 0;
-    temp = strrchr(filename, '/')+1;
-    dbg_printf("\r\n[DEBUG-tf_create] FILENAME CONVERSION: %s", temp);
-    tf_choose_sfn(entry.msdos.filename, temp, fp);
-    tf_printf("\r\n==== tf_create: SFN: %s", entry.msdos.filename);
     tf_place_lfn_chain(fp, temp, entry.msdos.filename);
     //tf_choose_sfn(entry.msdos.filename, temp, fp);
     //tf_shorten_filename(entry.msdos.filename, temp);
     //printf("\r\n==== tf_create: SFN: %s", entry.msdos.filename);
     tf_fwrite((uint8_t*)&entry, sizeof(FatFileEntry), 1, fp);
-    memset(&entry, 0, sizeof(FatFileEntry));
-    //entry.msdos.filename[0] = '\x00';
-    tf_fwrite((uint8_t*)&entry, sizeof(FatFileEntry), 1, fp);
+    tf_dir_index_add(fp->startCluster, temp, entry.msdos.filename, record, reuse ? TF_DIR_INDEX_EMPTY : fp->pos / sizeof(FatFileEntry));
+    if(!reuse) {
+        memset(&entry, 0, sizeof(FatFileEntry));
+        //entry.msdos.filename[0] = '\x00';
+        tf_fwrite((uint8_t*)&entry, sizeof(FatFileEntry), 1, fp);
+    }
     tf_fclose(fp);
     return 0;
 }
@@ -699,8 +1409,9 @@ int tf_mkdir(uint8_t *filename, int mkParents) {
     FatFileEntry entry, blank;
 
     uint32_t psc;
-    uint32_t cluster;
+    uint32_t cluster, record;
     uint8_t *temp;    
+    int reuse;
 
     strncpy( orig_fn, filename, TF_MAX_PATH-1 );
     orig_fn[ TF_MAX_PATH-1 ] = 0;
@@ -731,13 +1442,16 @@ int tf_mkdir(uint8_t *filename, int mkParents) {
     }
     
     dbg_printf("\r\n[DEBUG-tf_mkdir] Creating new directory: '%s'", filename);
+    temp = strrchr(filename, '/')+1;
+    dbg_printf("\r\n[DEBUG-tf_mkdir] DIRECTORY NAME CONVERSION: %s", temp);
+    // Choosing the 8.3 name indexes the directory, so it goes first (tf_shorten_filename() looks
+    // at what the name held before, which used to be the terminating record the scan stopped on)
+    memset(&entry, 0, sizeof(FatFileEntry));
+    tf_choose_sfn(entry.msdos.filename, temp, fp);
+    dbg_printf("\r\n==== tf_mkdir: SFN: %s", entry.msdos.filename);
     // Now we have the directory in which we want to create the file, open for overwrite
-    do {
-        tf_fread((uint8_t*)&entry, sizeof(FatFileEntry), fp);
-        tf_printf("Skipping existing directory entry... %d\n", fp->pos);
-    } while(entry.msdos.filename[0] != '\x00');
-    // Back up one entry, this is where we put the new filename entry
-    tf_fseek(fp, -sizeof(FatFileEntry), fp->pos);
+    reuse = tf_dir_seek_free(fp, (strlen((char *)temp)+LFN_ENTRY_CAPACITY-1)/LFN_ENTRY_CAPACITY + 1);
+    record = fp->pos / sizeof(FatFileEntry);
     
     // go find some space for our new friend
     cluster = tf_find_free_cluster();
@@ -755,10 +1469,6 @@ int tf_mkdir(uint8_t *filename, int mkParents) {
     entry.msdos.modifiedDate = 0x4262;
     entry.msdos.firstCluster = cluster & 0xffff;
     entry.msdos.fileSize = 0;
-    temp = strrchr(filename, '/')+1;
-    dbg_printf("\r\n[DEBUG-tf_mkdir] DIRECTORY NAME CONVERSION: %s", temp);
-    tf_choose_sfn(entry.msdos.filename, temp, fp);
-    dbg_printf("\r\n==== tf_mkdir: SFN: %s", entry.msdos.filename);
     tf_place_lfn_chain(fp, temp, entry.msdos.filename);
     //tf_choose_sfn(entry.msdos.filename, temp, fp);
     //tf_shorten_filename(entry.msdos.filename, temp, 1);
@@ -767,11 +1477,12 @@ int tf_mkdir(uint8_t *filename, int mkParents) {
     //entry.msdos.attributes = TF_ATTR_DIRECTORY ;
     //    dbg_printf("  4 mkdir: attr: %x ", entry.msdos.attributes);
     tf_fwrite((uint8_t*)&entry, sizeof(FatFileEntry), 1, fp);
+    tf_dir_index_add(fp->startCluster, temp, entry.msdos.filename, record, reuse ? TF_DIR_INDEX_EMPTY : fp->pos / sizeof(FatFileEntry));
     
     psc = fp->startCluster; // store this for later
     
-    // placing a 0 at the end of the FAT
-    tf_fwrite((uint8_t*)&blank, sizeof(FatFileEntry), 1, fp);
+    // placing a 0 at the end of the FAT, unless the entry went over deleted ones
+    if(!reuse) tf_fwrite((uint8_t*)&blank, sizeof(FatFileEntry), 1, fp);
     tf_fclose(fp);
     tf_release_handle(fp);
     
@@ -882,6 +1593,8 @@ TFFile *tf_fnopen(uint8_t *filename, const uint8_t *mode, int n) {
                                     // however, this is set in the BPB...
     fp->startCluster=2;
     fp->parentStartCluster=0xffffffff;
+    fp->direntPos=0;
+    fp->direntSector=0;
     fp->currentClusterIdx=0;
     fp->currentSector=0;
     fp->currentByte=0;
@@ -889,11 +1602,18 @@ TFFile *tf_fnopen(uint8_t *filename, const uint8_t *mode, int n) {
     fp->pos=0;
     fp->flags |= TF_FLAG_ROOT;
     fp->size = 0xffffffff;
-    //fp->size=tf_info.rootDirectorySize;
     fp->mode=TF_MODE_READ | TF_MODE_WRITE | TF_MODE_OVERWRITE;
 
 
     
+    fp->raPos = 0;
+    fp->raLimit = 0;
+    fp->raWindow = 0;
+    fp->delayIdx = 0;
+    fp->delayTail = 0;
+    fp->delayCount = 0;
+    tf_extent_reset(fp);
+
     while(temp_filename != NULL) {
         temp_filename = tf_walk(temp_filename, fp);
         if(fp->flags == 0xff) {
@@ -913,6 +1633,7 @@ TFFile *tf_fnopen(uint8_t *filename, const uint8_t *mode, int n) {
         fp->mode |= TF_MODE_WRITE | TF_MODE_OVERWRITE;
     }
     if(strchr(mode, '+')) fp->mode |= TF_MODE_OVERWRITE | TF_MODE_WRITE;
+    if(strchr((char const*)mode, 'd')) fp->mode |= TF_MODE_DELAYED;
     if(strchr(mode, 'w')) {
         /* Opened for writing. Truncate file only if it's not a directory*/
         if (!(fp->attributes & TF_ATTR_DIRECTORY)) {
@@ -924,6 +1645,7 @@ TFFile *tf_fnopen(uint8_t *filename, const uint8_t *mode, int n) {
                 tf_free_clusterchain(cluster);
                 tf_set_fat_entry(fp->startCluster, TF_MARK_EOC32);
             }
+            tf_extent_reset(fp);
         }
         fp->mode |= TF_MODE_WRITE;
     }
@@ -934,25 +1656,123 @@ TFFile *tf_fnopen(uint8_t *filename, const uint8_t *mode, int n) {
     return fp;
 }
 
+/*
+ * Free a chain of clusters
+ * ARGS
+ *   cluster - the first cluster of the chain
+ * SIDE EFFECTS
+ *   The chain is gathered TF_FREE_BATCH clusters at a time.  Each batch is sorted by cluster
+ *   number and its FAT entries are zeroed one FAT sector after the other, so that every sector
+ *   is fetched and dirtied once per batch.  The free cluster bitmap follows, and the free cluster
+ *   count is updated once per batch.  The walk stops at the end of the chain, or at anything that
+ *   isn't a cluster of the volume (a corrupt chain, which mustn't take the root directory with it).
+ * RETURN
+ *   0 for no error, nonzero if a FAT sector couldn't be read
+ */
 int tf_free_clusterchain(uint32_t cluster) {
-    uint32_t fat_entry;
+    uint32_t batch[TF_FREE_BATCH];
+    uint32_t n, i, j, c, sector, freed, *entry=NULL;
+    TFCacheEntry *e;
+    int rc=0;
     dbg_printf("\r\n[DEBUG-tf_free_clusterchain] Freeing clusterchain starting at cluster %d... ", cluster);
-    fat_entry = tf_get_fat_entry(cluster);
-    while(fat_entry < TF_MARK_EOC32) {
-        if (fat_entry <= 2)        // catch-all to save root directory from corrupted stuff
-        {
-            dbg_printf("\r\n\r\n+++++++++++++++++ SOMETHING WICKED THIS WAY COMES!  End of FAT cluster chain is <=2 (end should be 0x0ffffff8)\r\n");
-            break;
+
+    while(cluster >= 2 && cluster < tf_info.totalClusters) {
+        // Gather the next part of the chain
+        for(n=0; n<TF_FREE_BATCH && cluster >= 2 && cluster < tf_info.totalClusters; n++) {
+            batch[n] = cluster;
+            cluster = tf_get_fat_entry(cluster) & 0x0fffffff;
+        }
+        // Chains are mostly ascending already, which insertion sort gets through in one pass
+        for(i=1; i<n; i++) {
+            c = batch[i];
+            for(j=i; j>0 && batch[j-1] > c; j--) batch[j] = batch[j-1];
+            batch[j] = c;
+        }
+
+        // Zero the entries, a FAT sector at a time
+        sector = TF_CACHE_EMPTY;
+        freed = 0;
+        for(i=0; i<n; i++) {
+            if(batch[i] / 128 != sector) {     // 128 FAT32 entries per 512 byte sector
+                sector = batch[i] / 128;
+                entry = NULL;
+                if(tf_cache_fetch(&tf_info.fatCache, tf_info.fatStart + sector, &e)) rc |= 1;
+                else entry = (uint32_t*)e->data;
+            }
+            if(entry == NULL || (entry[batch[i] % 128] & 0x0fffffff) == 0) continue;
+            dbg_printf("\r\n[DEBUG-tf_free_clusterchain] Freeing cluster %d... ", batch[i]);
+            entry[batch[i] % 128] = 0x00000000;
+            e->flags |= TF_FLAG_DIRTY;
+            if(tf_info.freemapReady) tf_freemap_set(batch[i], 0);
+            freed++;
+        }
+        if(freed) {
+            if(tf_info.freeCount != TF_FREE_UNKNOWN) tf_info.freeCount += freed;
+            tf_info.fsinfoDirty = 1;
         }
-        dbg_printf("\r\n[DEBUG-tf_free_clusterchain] Freeing cluster %d... ", fat_entry);
-        tf_set_fat_entry(cluster, 0x00000000);
-        fat_entry = tf_get_fat_entry(fat_entry);
-        cluster = fat_entry;
     }
-    return 0;
+    return rc;
+}
+
+
+
+/*
+ * Forget what a handle knows about its cluster chain, but for the first cluster
+ * SIDE EFFECTS
+ *   fp->extents holds just fp->startCluster, at index 0
+ */
+void tf_extent_reset(TFFile *fp) {
+    fp->extents[0].index = 0;
+    fp->extents[0].cluster = fp->startCluster;
+    fp->extents[0].count = 1;
+    fp->extentCount = 1;
 }
 
+/*
+ * Look a cluster of a file up in the handle's extent map
+ * ARGS
+ *   fp - the file
+ *   index - the cluster's index in the file (0 for the first one)
+ * RETURN
+ *   the cluster number, or 0 if that part of the chain isn't mapped.  Clusters whose allocation
+ *   is delayed are never in the map, their placeholders are found all the same.
+ */
+uint32_t tf_extent_lookup(TFFile *fp, uint32_t index) {
+    int lo=0, hi=fp->extentCount-1, mid;
+    if(index - fp->delayIdx < fp->delayCount) {
+        return tf_info.delayBase + (uint32_t)(fp - tf_file_handles)*TF_DELAY_CLUSTERS + index - fp->delayIdx;
+    }
+    while(lo <= hi) {
+        mid = (lo + hi) / 2;
+        if(index < fp->extents[mid].index) hi = mid - 1;
+        else if(index - fp->extents[mid].index >= fp->extents[mid].count) lo = mid + 1;
+        else return fp->extents[mid].cluster + (index - fp->extents[mid].index);
+    }
+    return 0;
+}
 
+/*
+ * Record one more cluster of a file's chain, as it is walked
+ * ARGS
+ *   fp - the file
+ *   index - the cluster's index in the file
+ *   cluster - the cluster number
+ * SIDE EFFECTS
+ *   If the cluster directly follows the mapped part of the chain, it extends the last extent,
+ *   or starts a new one while there is room.  Anything else is ignored.
+ */
+void tf_extent_append(TFFile *fp, uint32_t index, uint32_t cluster) {
+    TFExtent *last = &fp->extents[fp->extentCount-1];
+    if(index != last->index + last->count) return;
+    if(cluster == last->cluster + last->count) last->count++;
+    else if(fp->extentCount < TF_FILE_EXTENTS) {
+        last++;
+        last->index = index;
+        last->cluster = cluster;
+        last->count = 1;
+        fp->extentCount++;
+    }
+}
 
 int tf_fseek(TFFile *fp, int32_t base, long offset) {
     long pos = base+offset;
@@ -968,6 +1788,7 @@ int tf_unsafe_fseek(TFFile *fp, int32_t base, long offset) {
     long pos = base + offset;
     uint32_t mark = tf_info.type ? TF_MARK_EOC32 : TF_MARK_EOC16;
     uint32_t temp;
+    TFExtent *last;
     // We're only allowed to seek one past the end of the file (For writing new stuff)
     if(pos > fp->size) {
                 dbg_printf("\r\n[DEBUG-tf_unsafe_fseek] SEEK ERROR (pos=%ld > fp.size=%d) ", pos, fp->size);
@@ -983,21 +1804,32 @@ int tf_unsafe_fseek(TFFile *fp, int32_t base, long offset) {
     cluster_idx = pos / (tf_info.sectorsPerCluster*512); // The cluster we want in the file
     //print_TFFile(fp);    
     // If the cluster index matches the index we're already at, we don't need to look in the FAT
-    // If it doesn't match, we have to follow the linked list to arrive at the correct cluster 
-    if(cluster_idx != fp->currentClusterIdx) {
-        temp = cluster_idx;
-        /* Shortcut: If we are looking for a cluster that comes *after* the current we don't
-         * need to start at the beginning */
-        if (cluster_idx > fp->currentClusterIdx) {
-            cluster_idx -= fp->currentClusterIdx;
-        } else {
-            fp->currentCluster = fp->startCluster;
-        }
-        fp->currentClusterIdx = temp;
-        while(cluster_idx > 0) {
+    // If it's in the part of the chain the handle has mapped already, we don't either
+    // Otherwise, we have to follow the linked list to arrive at the correct cluster 
+    if(cluster_idx != fp->currentClusterIdx && (temp = tf_extent_lookup(fp, cluster_idx)) != 0) {
+        fp->currentCluster = temp;
+        fp->currentClusterIdx = cluster_idx;
+    }
+    else if(cluster_idx != fp->currentClusterIdx) {
+        /* Shortcut: walk on from the current cluster if it comes before the one we are looking
+         * for and past the mapped part of the chain, from the end of the mapped part otherwise */
+        last = &fp->extents[fp->extentCount-1];
+        if(fp->delayCount && cluster_idx >= fp->delayIdx) {
+            // Past the clusters still waiting to be allocated, which are the last ones of the file
+            fp->currentClusterIdx = fp->delayIdx + fp->delayCount - 1;
+            fp->currentCluster = tf_extent_lookup(fp, fp->currentClusterIdx);
+        }
+        else if(cluster_idx < fp->currentClusterIdx || fp->currentClusterIdx < last->index + last->count) {
+            fp->currentClusterIdx = last->index + last->count - 1;
+            fp->currentCluster = last->cluster + last->count - 1;
+        }
+        while(fp->currentClusterIdx < cluster_idx) {
             // TODO Check file mode here for r/w/a/etc...
-            temp = tf_get_fat_entry(fp->currentCluster); // next, next, next
-            if(temp&0x0fffffff != mark) fp->currentCluster = temp;
+            // Clusters whose allocation is delayed are always the last ones of the file
+            if(tf_delay_virtual(fp->currentCluster)) temp = mark;
+            else temp = tf_get_fat_entry(fp->currentCluster); // next, next, next
+            if((temp & 0x0fffffff) < mark) fp->currentCluster = temp;
+            else if((temp = tf_delay_cluster(fp)) != 0) fp->currentCluster = temp;
             else {
                 // We've reached the last cluster in the file (omg)
                 // If the file is writable, we have to allocate new space
@@ -1008,12 +1840,13 @@ int tf_unsafe_fseek(TFFile *fp, int32_t base, long offset) {
                 tf_set_fat_entry(temp, mark); // Marks the new cluster as the last one
                 fp->currentCluster = temp;
             }
-            cluster_idx--;
+            fp->currentClusterIdx++;
             if(fp->currentCluster >= mark) {
-                if(cluster_idx > 0) {
+                if(fp->currentClusterIdx < cluster_idx) {
                     return     TF_ERR_INVALID_SEEK;
                 }
             }
+            if(!tf_delay_virtual(fp->currentCluster)) tf_extent_append(fp, fp->currentClusterIdx, fp->currentCluster);
         }
         // We now have the correct cluster number (whether we had to fetch it from the fat, or realized we already had it)
         // Now we need just compute the correct sector and byte index into the cluster
@@ -1031,10 +1864,13 @@ int tf_unsafe_fseek(TFFile *fp, int32_t base, long offset) {
  */
 int tf_find_file(TFFile *current_directory, uint8_t *name) {
     int rc;
-    tf_fseek(current_directory, 0, 0);
-    
     tf_printf("\r\n    [DEBUG-tf_find_file] Searching for filename: '%s' in directory '%s' ", name, current_directory->filename);
 
+    // The directory's name index has the answer, unless it is too full to hold every name
+    rc = tf_dir_index_find(current_directory, name);
+    if(rc <= 0) return rc;
+    tf_fseek(current_directory, 0, 0);
+
     while(1) {
         tf_printf("\r\n    [DEBUG-tf_find_file]     iteration: '%s' in directory '%s' ", name, current_directory->filename);
         
@@ -1049,201 +1885,521 @@ int tf_find_file(TFFile *current_directory, uint8_t *name) {
     tf_printf("\r\n    [DEBUG-tf_find_file] Exiting... returning -1");
     return -1;
 }
-/*! tf_compare_filename_segment compares a given filename against a particular
-FatFileEntry (a 32-byte structure pulled off disk, all of these are back-to-back
-in a typical Directory entry on the disk)
+/*
+ * Turn a raw 8.3 name into the form directory searches compare names with: the base name and
+ * the extension without their padding, joined by a dot (which is there even without an extension)
+ * ARGS
+ *   dest - set to the name, at least 13 bytes
+ *   sfn - the 11 bytes of the 8.3 name
+ * RETURN
+ *   the length of the name
+ */
+int tf_sfn_name(uint8_t *dest, uint8_t *sfn) {
+    int i, j=0;
+    for(i=0; i<8; i++) {
+        if(sfn[i] != ' ') dest[j++] = sfn[i];
+    }
+    dest[j++] = '.';
+    for(i=8; i<11; i++) {
+        if(sfn[i] != ' ') dest[j++] = sfn[i];
+    }
+    dest[j] = '\x00';
+    return j;
+}
 
-figures out formatted name, does comparison, and returns 0:failure, 1:match
-*/
-int tf_compare_filename_segment(FatFileEntry *entry, uint8_t *name) { //, uint8_t last) {
-    int i,j;
-    uint8_t reformatted_file[16];
-    uint8_t *entryname = entry->msdos.filename;
-    tf_printf("\r\n        [DEBUG-tf_compare_filename_segment] -- '%s'", name);
-    if(entry->msdos.attributes != 0x0f) {
-        
-        tf_printf(" 8.3 Segment: ");
-        // Filename
-        j=0;
-        for(i=0; i<8; i++) {
-            if(entryname[i] != ' ') {
-                reformatted_file[j++] = entryname[i];
-            }
-        }
-        reformatted_file[j++] = '.';
-        // Extension
-        for(i=8; i<11; i++) {
-            if(entryname[i] != ' ') {
-                reformatted_file[j++] = entryname[i];
-            }
+/*
+ * Read the next entry of a directory, along with its long name
+ * ARGS
+ *   dir - the directory, positioned on a record
+ *   entry - set to the entry's 8.3 record
+ *   lfn - set to the entry's long name, at least TF_LFN_ENTRIES*LFN_ENTRY_CAPACITY+1 bytes.  It
+ *         is empty if the entry has none, or if the LFN records in front of it don't belong to it
+ *         (their sequence is broken, or their checksum isn't that of the 8.3 name).
+ *   record - set to the number of the entry's first record: the start of its LFN chain, or the
+ *            8.3 record itself
+ * SIDE EFFECTS
+ *   The LFN chain is decoded in the order it is stored, last part of the name first, so the
+ *   directory is only ever read forward.  Deleted records are skipped.  dir is left right after
+ *   the 8.3 record, or on the terminating record at the end of the directory.
+ * RETURN
+ *   0 for an entry, -1 at the end of the directory, -2 if the directory ran out without one
+ */
+int tf_dir_read(TFFile *dir, FatFileEntry *entry, uint8_t *lfn, uint32_t *record) {
+    uint8_t *chars, sum=0;
+    uint16_t c;
+    uint32_t pos;
+    int i, k, next=-1;      // sequence number of the LFN record expected next, -1 outside a chain
+
+    lfn[0] = '\x00';
+    while(1) {
+        pos = dir->pos;
+        if(tf_fread((uint8_t*)entry, sizeof(FatFileEntry), dir) && dir->pos == pos) return -2;
+        if(entry->msdos.filename[0] == 0x00) {
+            tf_fseek(dir, 0, pos);
+            return -1;
         }
-    }
-    else {
-        tf_printf(" LFN Segment: ");
-        j=0;
-        for(i=0; i<5; i++) {
-            reformatted_file[j++] = (uint8_t) entry->lfn.name1[i];
+        if(entry->msdos.filename[0] == 0xe5) {
+            next = -1;
+            continue;
         }
-        for(i=0; i<6; i++) {
-            reformatted_file[j++] = (uint8_t) entry->lfn.name2[i];
+        if(entry->msdos.attributes != 0x0f) break;
+
+        k = entry->lfn.sequence_number & 0x1f;
+        if(entry->lfn.sequence_number & 0x40) {
+            // The first record holds the last part of the name, and says how many there are
+            next = (k == 0 || k > TF_LFN_ENTRIES) ? -1 : k;
+            sum = entry->lfn.checksum;
+            *record = pos / sizeof(FatFileEntry);
+            if(next > 0) lfn[k*LFN_ENTRY_CAPACITY] = '\x00';
         }
-        for(i=0; i<2; i++) {
-            reformatted_file[j++] = (uint8_t) entry->lfn.name3[i];
+        if(next <= 0 || k != next || entry->lfn.checksum != sum) {
+            next = -1;
+            continue;
         }
-    }
-    reformatted_file[j++] = '\x00';
-    i=0;
-    while((name[i] != '/') && (name[i] != '\x00')) i++; // will this work for 8.3?  this should be calculated in the section with knowledge of lfn/8.3
-    
-    tf_printf("\r\n        [DEBUG] Comparing filename segment '%s' (given) to '%s' (from disk) ", name, reformatted_file);
-    // FIXME: only compare the 13 or less bytes left in the reformatted_file string... but that doesn't match all the way to the end of the test string....
-    
-    
-    // the role of 'i' changes here to become the return value.  perhaps this doesn't gain us enough in performance to avoid using a real retval?
-    /// PROBLEM: THIS FUNCTION assumes that if the length of the "name" is tested by the caller.
-    ///   if the LFN pieces all match, but the "name" is longer... this will never fail.
-    if (i>13)
-    {
-        if (strncasecmp(name, reformatted_file, 13)) 
-        {
-            tf_printf("  - 0 (doesn't match)\r\n");
-            i = 0;
-        } else
-        {
-            tf_printf("  - 1 (match)\r\n");
-            i = 1;
+        chars = &lfn[(k-1)*LFN_ENTRY_CAPACITY];
+        for(i=0; i<LFN_ENTRY_CAPACITY; i++) {
+            c = (i < 5) ? entry->lfn.name1[i] : (i < 11) ? entry->lfn.name2[i-5] : entry->lfn.name3[i-11];
+            chars[i] = (c == 0xffff) ? '\x00' : (uint8_t) c;
         }
+        next--;
     }
-    else { 
-        if (reformatted_file[i] != 0 || strncasecmp(name, reformatted_file, i)) 
-        {
-            i = 0;
-            tf_printf("  - 0 (doesn't match)\r\n");
-        } else
-        {
-            i = 1;
-            tf_printf("  - 1 (match)\r\n");
-        }
+    if(next != 0 || tf_lfn_checksum(entry->msdos.filename) != sum) {
+        lfn[0] = '\x00';
+        *record = pos / sizeof(FatFileEntry);
     }
-    return i;
+    return 0;
 }
-// 
-// Reads a single FatFileEntry from fp, compares it to the MSDOS filename specified by *name
+
+/*
+ * Check a name against a directory entry read with tf_dir_read(), without regard to case
+ * ARGS
+ *   entry - the entry's 8.3 record
+ *   lfn - the entry's long name, empty if it has none
+ *   name - the name (not terminated)
+ *   length - the length of the name
+ * RETURN
+ *   1 if the name is the entry's long name or its 8.3 name, 0 otherwise
+ */
+int tf_dir_name_match(FatFileEntry *entry, uint8_t *lfn, uint8_t *name, int length) {
+    uint8_t sfn[13];
+    if(lfn[0] && strlen((char *)lfn) == length && !strncasecmp((char *)lfn, (char *)name, length)) return 1;
+    return tf_sfn_name(sfn, entry->msdos.filename) == length && !strncasecmp((char *)sfn, (char *)name, length);
+}
+
+//
+// Reads a single directory entry (with its LFN chain, if it has one) from fp, compares it to the
+// filename specified by *name, which ends at the first '/' or at the end of the string
 // Returns:
-//   1 for entry matches filename.  Side effect: fp seeks to that entry
-//   0 for entry doesn't match filename.  Side effect: fp seeks to next entry
+//   1 for entry matches filename.  Side effect: fp seeks to its 8.3 record
+//   0 for entry doesn't match filename.  Side effect: fp seeks to the next entry
 //   -1 for couldn't read an entry, due to EOF or other fread error
 //
 int tf_compare_filename(TFFile *fp, uint8_t *name) {
-    uint32_t i,j=0;
-    uint32_t namelen;
     FatFileEntry entry;
-    uint8_t *compare_name=name;
-    uint32_t lfn_entries;
-    
-    // Read a single directory entry
+    uint8_t lfn[TF_LFN_ENTRIES*LFN_ENTRY_CAPACITY+1];
+    uint32_t record;
+    int length;
+
     tf_printf("\r\n      [DEBUG-tf_compare_filename] Comparing filename @ %d ", fp->pos);
-    tf_fread((uint8_t*)&entry, sizeof(FatFileEntry), fp);
-    
-    // Fail if its bogus
-    if(entry.msdos.filename[0] == 0x00) return -1;
-
-    // If it's a DOS entry, then:
-    if(entry.msdos.attributes != 0x0f) {
-        // If it's a match, seek back an entry to the beginning of it, return 1
-        if(1==tf_compare_filename_segment(&entry, name)) { //, true)) {
-            tf_fseek(fp, -sizeof(FatFileEntry), fp->pos);
-            tf_printf("\r\n      [DEBUG-tf_compare_filename] 8.3 Exiting... returning 1 (match)");
-            return 1;
-        }else {
-            tf_printf("\r\n      [DEBUG-tf_compare_filename] 8.3 Exiting... returning 0 (doesn't match)");
-            return 0;
+    if(tf_dir_read(fp, &entry, lfn, &record)) {
+        tf_printf("\r\n      [DEBUG-tf_compare_filename] (---) Exiting... returning -1 ");
+        return -1;
+    }
+    for(length=0; (name[length] != '/') && (name[length] != '\x00'); length++);
+    if(tf_dir_name_match(&entry, lfn, name, length)) {
+        tf_fseek(fp, -(int32_t)sizeof(FatFileEntry), fp->pos);
+        tf_printf("\r\n      [DEBUG-tf_compare_filename] Exiting... returning 1 (match)");
+        return 1;
+    }
+    tf_printf("\r\n      [DEBUG-tf_compare_filename] Exiting... returning 0 (doesn't match)");
+    return 0;
+}
+
+/*
+ * Find the name index of a directory
+ * ARGS
+ *   dir - the first cluster of the directory
+ * RETURN
+ *   the index, or NULL if the directory has none
+ */
+TFDirIndex *tf_dir_index_get(uint32_t dir) {
+    int i;
+    for(i=0; i<TF_DIR_INDEXES; i++) {
+        if(tf_dir_indexes[i].dirCluster == dir && dir != 0) {
+            tf_dir_indexes[i].lastUse = ++tf_info.dirIndexClock;
+            return &tf_dir_indexes[i];
         }
     }
-    else if ((entry.lfn.sequence_number & 0xc0) == 0x40)
-    {
-        //CHECK FOR 0x40 bit set or this is not the first (last) LFN entry!
-        // If this is the first LFN entry, mask off the extra bit (0x40) and you get the number of entries in the chain
-        lfn_entries = entry.lfn.sequence_number & ~0x40;
-        dbg_printf("\r\n=== LFN entries: %x   pos: %x  last entry:", lfn_entries, fp->pos);
-        dbg_printHex((char*)&entry, 32);
-        
-        // Seek to the last entry in the chain (LFN entries store name in reverse, so the last shall be first)
-        tf_fseek(fp, (int32_t)sizeof(FatFileEntry)*(lfn_entries-1), fp->pos);
-        tf_printf("\r\n pos: %x", fp->pos);
+    return NULL;
+}
 
-        // get the length of the file first off.  LFN count should be easily checked from here.
-        namelen = strlen(name);
-        if (((namelen + 12) / LFN_ENTRY_CAPACITY) != lfn_entries)
-        {
-            // skip this LFN, it isn't it.
-            //  not necessary, we're already there.  // tf_fseek(fp, (int32_t)((i))*sizeof(FatFileEntry), fp->pos);
-            tf_printf("\r\n pos: %x", fp->pos);
-            tf_printf("\r\n      [DEBUG-tf_compare_filename] LFN Exiting... returning 0  (no match)");
-            return 0;
+/*
+ * Add a name to a directory's name index
+ * ARGS
+ *   index - the index
+ *   name - the name (not terminated)
+ *   length - the length of the name
+ *   record - the number of the first record of the entry with that name
+ * SIDE EFFECTS
+ *   An index already 3/4 full, or a record past what a slot can hold, leaves the index
+ *   incomplete.  Names are no longer added to it then.
+ */
+void tf_dir_index_insert(TFDirIndex *index, uint8_t *name, int length, uint32_t record) {
+    uint32_t hash, i;
+
+    if(!index->complete) return;
+    if(record > 0xffff || index->count >= TF_DIR_INDEX_SLOTS/4*3) {
+        dbg_printf("\r\n[DEBUG-tf_dir_index_insert] Index of %x is full", index->dirCluster);
+        index->complete = 0;
+        return;
+    }
+    hash = tf_dentry_hash(index->dirCluster, name, length);
+    for(i=hash & (TF_DIR_INDEX_SLOTS-1); index->slots[i] < TF_DIR_INDEX_DELETED; i=(i+1) & (TF_DIR_INDEX_SLOTS-1));
+    if(index->slots[i] == TF_DIR_INDEX_EMPTY) index->count++;
+    index->slots[i] = ((hash >> 17) << 16) | record;
+}
+
+/*
+ * Take a name of a removed entry out of a directory's name index
+ * ARGS
+ *   index - the index
+ *   name - the name (not terminated)
+ *   length - the length of the name
+ *   record - the number of the entry's first record
+ * SIDE EFFECTS
+ *   The name's slot is marked deleted rather than emptied, so that the names probed past it
+ *   are still found.  New names can take it over.
+ */
+void tf_dir_index_remove(TFDirIndex *index, uint8_t *name, int length, uint32_t record) {
+    uint32_t hash, i;
+
+    hash = tf_dentry_hash(index->dirCluster, name, length);
+    for(i=hash & (TF_DIR_INDEX_SLOTS-1); index->slots[i] != TF_DIR_INDEX_EMPTY; i=(i+1) & (TF_DIR_INDEX_SLOTS-1)) {
+        if(index->slots[i] == (((hash >> 17) << 16) | record)) {
+            index->slots[i] = TF_DIR_INDEX_DELETED;
+            return;
         }
-    
-        for(i=0; i<lfn_entries; i++) {
-            // Seek back one and read it
-            tf_printf("\r\n      [DEBUG-tf_compare_filename] LFN loop... %x::%x", i, lfn_entries);
-            tf_fseek(fp, -sizeof(FatFileEntry), fp->pos);
-            tf_printf("\r\n pos: %x", fp->pos);
-            tf_fread((uint8_t*)&entry, sizeof(FatFileEntry), fp);
-            tf_printf("\r\n pos: %x", fp->pos);
-        
-            // Compare it.  If it's not a match, jump to the end of the chain, return failure 
-            // Otherwise, continue looping until there's no entries left.
-            if(!tf_compare_filename_segment(&entry, compare_name)) { //, (i==lfn_entries-1))) {
-                tf_fseek(fp, (int32_t)((i))*sizeof(FatFileEntry), fp->pos);
-                tf_printf("\r\n pos: %x", fp->pos);
-                tf_printf("\r\n      [DEBUG-tf_compare_filename] LFN Exiting... returning 0  (no match)");
-                return 0;
-            }
-            tf_fseek(fp, -sizeof(FatFileEntry), fp->pos);
-            tf_printf("\r\n pos: %x", fp->pos);
-        
-            compare_name+=13;
+    }
+}
+
+/*
+ * Remember a run of deleted records of a directory for new entries to reuse
+ * ARGS
+ *   index - the directory's name index
+ *   record - the first record of the run
+ *   count - the number of records in the run
+ * SIDE EFFECTS
+ *   Runs it touches are merged into it.  With no unused run left, it replaces the shortest one,
+ *   if that is shorter.  Whichever run is left out goes toward index->lostRun.
+ */
+void tf_dir_index_free(TFDirIndex *index, uint32_t record, uint32_t count) {
+    TFDirRun *run, *victim;
+    int i;
+
+    if(record + count > 0x10000) return;
+    for(i=0; i<TF_DIR_FREE_RUNS; i++) {
+        run = &index->freeRuns[i];
+        if(run->count && (run->record + run->count == record || record + count == run->record)) {
+            if(run->record < record) record = run->record;
+            count += run->count;
+            run->count = 0;
+            i = -1;     // the bigger run may touch one already looked at
         }
-        // If we made it here, match was a success!  Return so... 
-        // ONLY if next entry is valid!
-        tf_fseek(fp, (int32_t)sizeof(FatFileEntry)*lfn_entries, fp->pos);
-        tf_printf("\r\n      [DEBUG-tf_compare_filename] LFN Exiting... returning 1 ");
+    }
+    victim = &index->freeRuns[0];
+    for(i=1; i<TF_DIR_FREE_RUNS; i++) {
+        if(index->freeRuns[i].count < victim->count) victim = &index->freeRuns[i];
+    }
+    if(victim->count >= count) {
+        if(count > index->lostRun) index->lostRun = count;
+        return;
+    }
+    if(victim->count > index->lostRun) index->lostRun = victim->count;
+    victim->record = record;
+    victim->count = count;
+}
+
+/*
+ * Record a new entry in a directory's name index, if it has one
+ * ARGS
+ *   dir - the first cluster of the directory
+ *   lfn - the entry's long name
+ *   sfn - the 11 bytes of its 8.3 name
+ *   record - the number of its first record
+ *   end - the number of the directory's terminating record, now that the entry is in, or
+ *         TF_DIR_INDEX_EMPTY if the entry took deleted records and the end didn't move
+ */
+void tf_dir_index_add(uint32_t dir, uint8_t *lfn, uint8_t *sfn, uint32_t record, uint32_t end) {
+    TFDirIndex *index = tf_dir_index_get(dir);
+    uint8_t name[13];
+
+    if(index == NULL) return;
+    if(lfn[0]) tf_dir_index_insert(index, lfn, strlen((char *)lfn), record);
+    tf_dir_index_insert(index, name, tf_sfn_name(name, sfn), record);
+    if(end != TF_DIR_INDEX_EMPTY) index->end = end;
+}
+
+/*
+ * Position a directory where a new entry is to be written
+ * ARGS
+ *   dir - the directory, at its start
+ *   count - the number of records the entry takes (its LFN chain and 8.3 record)
+ * SIDE EFFECTS
+ *   The entry goes into a run of deleted records if there's one long enough (the shortest that
+ *   is, according to the directory's name index, or the first one found), otherwise it goes at the
+ *   end, over the terminating record.
+ * RETURN
+ *   1 if the entry goes over deleted records, 0 if it goes at the end, where a new terminating
+ *   record has to follow it
+ */
+int tf_dir_seek_free(TFFile *dir, uint32_t count) {
+    TFDirIndex *index = tf_dir_index_get(dir->startCluster);
+    TFDirRun *run = NULL;
+    FatFileEntry entry;
+    uint32_t deleted = 0;
+    int i;
+
+    if(index != NULL) {
+        for(i=0; i<TF_DIR_FREE_RUNS; i++) {
+            if(index->freeRuns[i].count >= count && (run == NULL || index->freeRuns[i].count < run->count)) run = &index->freeRuns[i];
+        }
+        if(run == NULL && index->lostRun >= count) {
+            // A run that would do was left out of the index: read the directory again to find it
+            tf_dir_index_drop(dir->startCluster);
+            tf_dir_index_build(dir, (uint8_t *)"", 0);
+            return tf_dir_seek_free(dir, count);
+        }
+        if(run == NULL) {
+            tf_fseek(dir, 0, index->end*sizeof(FatFileEntry));
+            return 0;
+        }
+        tf_fseek(dir, 0, run->record*sizeof(FatFileEntry));
+        run->record += count;
+        run->count -= count;
         return 1;
     }
-    tf_printf("\r\n      [DEBUG-tf_compare_filename] (---) Exiting... returning -1 ");
-    return -1;
+    do {
+        //"seek" to the end, unless a run of deleted records turns up first
+        tf_fread((uint8_t*)&entry, sizeof(FatFileEntry), dir);
+        tf_printf("Skipping existing directory entry... %d\r\n", dir->pos);
+        if(entry.msdos.filename[0] != 0xe5) deleted = 0;
+        else if(++deleted == count) {
+            tf_fseek(dir, 0, dir->pos - count*sizeof(FatFileEntry));
+            return 1;
+        }
+    } while(entry.msdos.filename[0] != '\x00');
+    // Back up one entry, this is where we put the new filename entry
+    tf_fseek(dir, -(int32_t)sizeof(FatFileEntry), dir->pos);
+    return 0;
+}
+
+/*
+ * Drop the name index of a directory whose entries moved, or of every directory
+ * ARGS
+ *   dir - the first cluster of the directory, 0 for all of them
+ */
+void tf_dir_index_drop(uint32_t dir) {
+    int i;
+    for(i=0; i<TF_DIR_INDEXES; i++) {
+        if(dir == 0 || tf_dir_indexes[i].dirCluster == dir) tf_dir_indexes[i].dirCluster = 0;
+    }
+}
+
+/*
+ * Build the name index of a directory, looking for a name on the way
+ * ARGS
+ *   dir - the directory
+ *   name - the name to look for (not terminated)
+ *   length - the length of the name
+ * SIDE EFFECTS
+ *   The directory is read once from start to end, every name it holds going into the index
+ *   that was used the longest time ago.  If the name is there, dir is left on its 8.3 record.
+ * RETURN
+ *   0 if the name was found, -1 otherwise
+ */
+int tf_dir_index_build(TFFile *dir, uint8_t *name, int length) {
+    TFDirIndex *index = &tf_dir_indexes[0];
+    FatFileEntry entry;
+    uint8_t lfn[TF_LFN_ENTRIES*LFN_ENTRY_CAPACITY+1], sfn[13];
+    uint32_t record, next=0, found=0xffffffff;
+    int i;
+
+    for(i=1; i<TF_DIR_INDEXES && index->dirCluster != 0; i++) {
+        if(tf_dir_indexes[i].dirCluster == 0 || tf_dir_indexes[i].lastUse < index->lastUse) index = &tf_dir_indexes[i];
+    }
+    dbg_printf("\r\n[DEBUG-tf_dir_index_build] Indexing directory %x", dir->startCluster);
+    index->dirCluster = dir->startCluster;
+    index->lastUse = ++tf_info.dirIndexClock;
+    index->count = 0;
+    index->complete = 1;
+    memset(index->slots, 0xff, sizeof(index->slots));
+    memset(index->freeRuns, 0, sizeof(index->freeRuns));
+    index->lostRun = 0;
+
+    tf_fseek(dir, 0, 0);
+    while((i = tf_dir_read(dir, &entry, lfn, &record)) == 0) {
+        // Records skipped since the previous entry are deleted (or stray LFN records): free space
+        if(record > next) tf_dir_index_free(index, next, record - next);
+        next = dir->pos / sizeof(FatFileEntry);
+        if(lfn[0]) tf_dir_index_insert(index, lfn, strlen((char *)lfn), record);
+        tf_dir_index_insert(index, sfn, tf_sfn_name(sfn, entry.msdos.filename), record);
+        if(found == 0xffffffff && tf_dir_name_match(&entry, lfn, name, length)) found = dir->pos - sizeof(FatFileEntry);
+    }
+    // Without a terminating record there's nowhere known to add entries
+    if(i == -1) {
+        index->end = dir->pos / sizeof(FatFileEntry);
+        if(index->end > next) tf_dir_index_free(index, next, index->end - next);
+    }
+    else index->dirCluster = 0;
+    if(found == 0xffffffff) return -1;
+    tf_fseek(dir, 0, found);
+    return 0;
+}
+
+/*
+ * Look a name up in the name index of a directory, building the index first if there isn't one
+ * ARGS
+ *   dir - the directory
+ *   name - the name to look for, which ends at the first '/' or at the end of the string
+ * SIDE EFFECTS
+ *   If the name is found, dir is left on the 8.3 record of its entry
+ * RETURN
+ *   0 if the name was found, -1 if it isn't in the directory, 1 if the index can't tell because
+ *   it filled up before every name was in
+ */
+int tf_dir_index_find(TFFile *dir, uint8_t *name) {
+    TFDirIndex *index;
+    FatFileEntry entry;
+    uint8_t lfn[TF_LFN_ENTRIES*LFN_ENTRY_CAPACITY+1];
+    uint32_t hash, i, record;
+    int length;
+
+    for(length=0; (name[length] != '/') && (name[length] != '\x00'); length++);
+    index = tf_dir_index_get(dir->startCluster);
+    if(index == NULL) return tf_dir_index_build(dir, name, length);
+
+    // Every slot with the name's tag is a candidate, the directory says which one it really is
+    hash = tf_dentry_hash(dir->startCluster, name, length);
+    for(i=hash & (TF_DIR_INDEX_SLOTS-1); index->slots[i] != TF_DIR_INDEX_EMPTY; i=(i+1) & (TF_DIR_INDEX_SLOTS-1)) {
+        if((index->slots[i] >> 16) != (hash >> 17)) continue;
+        tf_fseek(dir, 0, (index->slots[i] & 0xffff)*sizeof(FatFileEntry));
+        if(tf_dir_read(dir, &entry, lfn, &record) == 0 && tf_dir_name_match(&entry, lfn, name, length)) {
+            tf_fseek(dir, -(int32_t)sizeof(FatFileEntry), dir->pos);
+            return 0;
+        }
+    }
+    return index->complete ? -1 : 1;
+}
+
+/*
+ * Read ahead of a sequential reader
+ * ARGS
+ *   fp - the file being read, positioned on the sector about to be read
+ * SIDE EFFECTS
+ *   Once a file has been read past one sector without seeking, the next fp->raWindow sectors of
+ *   its cluster chain (starting with the current one) are read into tf_info.cache in one batch,
+ *   and the window doubles, up to TF_READAHEAD_MAX.  Nothing happens while the reader is still
+ *   inside sectors read ahead earlier, or on devices that map their media.
+ */
+void tf_readahead(TFFile *fp) {
+    uint32_t idx, count, run, first, cluster;
+
+    idx = fp->pos / 512;
+    if(idx < fp->raLimit || fp->pos >= fp->size || tf_info.dev->map) return;
+    if(fp->raWindow == 0) {
+        // First sector since the last seek: only start reading ahead if the reader goes on
+        fp->raWindow = TF_READAHEAD_MIN;
+        fp->raLimit = idx + 1;
+        return;
+    }
+
+    count = fp->raWindow;
+    if(count > fp->size/512 + 1 - idx) count = fp->size/512 + 1 - idx;
+    fp->raLimit = idx + count;
+    fp->raWindow = (fp->raWindow*2 > TF_READAHEAD_MAX) ? TF_READAHEAD_MAX : fp->raWindow*2;
+    dbg_printf("\r\n[DEBUG-tf_readahead] Reading %d sectors ahead of file sector %d", count, idx);
+
+    cluster = fp->currentCluster;
+    first = fp->currentByte / 512;
+    for(;;) {
+        run = tf_info.sectorsPerCluster - first;
+        if(run > count) run = count;
+        tf_cache_prefetch(&tf_info.cache, tf_first_sector(cluster) + first, run);
+        count -= run;
+        if(count == 0) break;
+        cluster = tf_get_fat_entry(cluster) & 0x0fffffff;
+        if(cluster < 2 || cluster >= TF_MARK_BAD_CLUSTER32) break;
+        first = 0;
+    }
+
+    // Reading ahead may have evicted the current sector
+    if(tf_info.current->sector != tf_info.currentSector) tf_info.currentSector = TF_CACHE_EMPTY;
 }
 
 int tf_fread(uint8_t *dest, int size, TFFile *fp) {
-    uint32_t sector;
+    uint32_t sector, run, span;
+    // Whole sectors are read straight from the device, so what the file wrote needs its clusters
+    if(fp->delayCount) tf_delay_commit(fp);
+    // A read that doesn't pick up where the last one stopped starts a new read ahead window
+    if(fp->pos != fp->raPos) {
+        fp->raWindow = 0;
+        fp->raLimit = 0;
+    }
     while(size > 0) {
         sector = tf_first_sector(fp->currentCluster) + (fp->currentByte / 512);
-        tf_fetch(sector);       // wtfo?  i know this is cached, but why!?
-        //printHex(&tf_info.buffer[fp->currentByte % 512], 1);
-        *dest++ = tf_info.buffer[fp->currentByte % 512];
-        size--;
-        if(fp->attributes & TF_ATTR_DIRECTORY) {
-            //dbg_printf("READING DIRECTORY");
-            if(tf_fseek(fp, 0, fp->pos+1)) {
+        // Whole sectors starting on a sector boundary are read straight into dest, as many in
+        // one transfer as the current cluster allows.  The last byte of the file is left to
+        // the span copy below, which reports EOF.
+        run = size / 512;
+        if(run > tf_info.sectorsPerCluster - (fp->currentByte / 512))
+            run = tf_info.sectorsPerCluster - (fp->currentByte / 512);
+        if(fp->pos >= fp->size)
+            run = 0;
+        else if(fp->size - fp->pos <= run*512)
+            run = (fp->size - fp->pos - 1) / 512;
+        if((fp->currentByte % 512) == 0 && run > 0) {
+            tf_fetch_run(dest, sector, run);
+            dest += run*512;
+            size -= run*512;
+            if(tf_fseek(fp, 0, fp->pos + run*512)) {
+                fp->raPos = fp->pos;
                 return -1;
             }
-        } else {
-        if(tf_fseek(fp, 0, fp->pos +1)) {
-            return -1;    
+            continue;
+        }
+        // Otherwise copy what is left of the current sector, up to the last byte of the file
+        span = 512 - (fp->currentByte % 512);
+        if(span > (uint32_t)size) span = size;
+        if(fp->pos >= fp->size) span = 1;
+        else if(span > fp->size - fp->pos) span = fp->size - fp->pos;
+        tf_readahead(fp);
+        tf_fetch(sector);
+        memcpy(dest, &tf_info.buffer[fp->currentByte % 512], span);
+        dest += span;
+        size -= span;
+        if(fp->pos + span >= fp->size) {
+            // That was the last byte: stay on it and report EOF
+            tf_fseek(fp, 0, fp->pos + span - 1);
+            fp->raPos = fp->pos;
+            return -1;
         }
+        if(tf_fseek(fp, 0, fp->pos + span)) {
+            fp->raPos = fp->pos;
+            return -1;
         }
     }
+    fp->raPos = fp->pos;
     return 0;
 }
 
 int tf_fwrite(uint8_t *src, int size, int count, TFFile *fp) {
     int i, tracking, segsize;
+    uint32_t sector, run;
     dbg_printf("\r\n[DEBUG-tf_write] Call to tf_fwrite() size=%d count=%d \r\n", size, count);
     //printHex(src, size);
     fp->flags |= TF_FLAG_DIRTY;
     while(count > 0) {
         i=size;
-        fp->flags |= TF_FLAG_SIZECHANGED;
         while(i > 0) {  // really suboptimal for performance.  optimize.
             /*
             tf_fetch(tf_first_sector(fp->currentCluster) + (fp->currentByte / 512));
@@ -1253,7 +2409,7 @@ int tf_fwrite(uint8_t *src, int size, int count, TFFile *fp) {
             tf_printHex(tf_info.buffer, 512);
 
             tf_info.buffer[fp->currentByte % 512] = *((uint8_t *) src++);
-            tf_info.sectorFlags |= TF_FLAG_DIRTY; // Mark this sector as dirty
+            tf_info.current->flags |= TF_FLAG_DIRTY; // Mark this sector as dirty
             i--;
             tf_printf("\r\nfwrite2: cB:%x   pos: %x    tracking:%x   i/512: %x   fp->size: %x   fp->pos: %x\r\n", 
                    fp->currentByte, fp->pos, tracking, (i<512 ? i:512), fp->size, fp->pos);
@@ -1268,22 +2424,54 @@ int tf_fwrite(uint8_t *src, int size, int count, TFFile *fp) {
             */
             ///*
             // FIXME: even this new algorithm could be more efficient by elegantly combining count/size
-            tf_fetch(tf_first_sector(fp->currentCluster) + (fp->currentByte / 512));
+            sector = tf_first_sector(fp->currentCluster) + (fp->currentByte / 512);
             tracking = fp->currentByte % 512;
-            segsize = (i<512 ? i:512);
-            
-            tf_printf("\r\nfwrite1: cB:%x   tracking:%x   i/512: %x   fp->size: %x   fp->pos: %x\r\n", 
-                   fp->currentByte, tracking, segsize, fp->size, fp->pos);
-            tf_printHex(tf_info.buffer, 512);
             
-            memcpy( &tf_info.buffer[ tracking ], src, segsize);
-            tf_info.sectorFlags |= TF_FLAG_DIRTY; // Mark this sector as dirty
+            // Whole sectors starting on a sector boundary go straight to the disk, as many in
+            // one transfer as the current cluster allows
+            run = i / 512;
+            if(run > tf_info.sectorsPerCluster - (fp->currentByte / 512))
+                run = tf_info.sectorsPerCluster - (fp->currentByte / 512);
+            if(tracking == 0 && run > 0) {
+                // These bypass the cache, so the cluster can't wait to be allocated
+                if(tf_delay_virtual(fp->currentCluster)) {
+                    tf_delay_commit(fp);
+                    sector = tf_first_sector(fp->currentCluster) + (fp->currentByte / 512);
+                }
+                segsize = run * 512;
+                tf_printf("\r\nfwrite: direct write of %d sectors at %x\r\n", run, sector);
+                tf_store_run(src, sector, run);
+            }
+            else {
+                segsize = 512 - tracking;
+                if(i < segsize) segsize = i;
+                // Nothing needs reading if the write covers all of the file's data in the sector
+                if(tracking == 0 && fp->pos + segsize >= fp->size) tf_fetch_blank(sector);
+                else tf_fetch(sector);
+                // Making room in the cache allocates delayed clusters, which moves the sector
+                if(sector != tf_first_sector(fp->currentCluster) + (fp->currentByte / 512)) {
+                    tf_info.current->sector = TF_CACHE_EMPTY;
+                    tf_info.currentSector = TF_CACHE_EMPTY;
+                    sector = tf_first_sector(fp->currentCluster) + (fp->currentByte / 512);
+                    if(tracking == 0 && fp->pos + segsize >= fp->size) tf_fetch_blank(sector);
+                    else tf_fetch(sector);
+                }
+                
+                tf_printf("\r\nfwrite1: cB:%x   tracking:%x   i/512: %x   fp->size: %x   fp->pos: %x\r\n", 
+                       fp->currentByte, tracking, segsize, fp->size, fp->pos);
+                tf_printHex(tf_info.buffer, 512);
+                
+                memcpy( &tf_info.buffer[ tracking ], src, segsize);
+                tf_info.current->flags |= TF_FLAG_DIRTY; // Mark this sector as dirty
+            }
             
-            if (fp->pos + segsize > fp->size)
+            // A file that grows keeps its size one past the last byte written (see tf_unsafe_fseek)
+            if (fp->pos + segsize >= fp->size)
             {
-                tf_printf("\r\n++ increasing filesize:  %x + %x > %x",
+                tf_printf("\r\n++ increasing filesize:  %x + %x >= %x",
                        fp->pos , segsize , fp->size);
-                fp->size += segsize - (fp->pos % 512);
+                fp->size = fp->pos + segsize + 1;
+                fp->flags |= TF_FLAG_SIZECHANGED;
             }
             
             tf_printf("\r\nfwrite2: cB:%x    tracking:%x   i/512: %x   fp->size: %x   fp->pos: %x\r\n", 
@@ -1298,9 +2486,299 @@ int tf_fwrite(uint8_t *src, int size, int count, TFFile *fp) {
             src += segsize;
             //*/
         }
-        count--;
+        count--;
+    }
+    return size - i;
+}
+
+/*
+ * Reserve space for a file ahead of writing it
+ * ARGS
+ *   fp - the file
+ *   bytes - the size the file is going to grow to
+ * SIDE EFFECTS
+ *   The file's cluster chain is extended, if needed, to hold bytes bytes, a run of clusters at
+ *   a time (see tf_allocate_run()).  The file size doesn't change: later writes past the end
+ *   use the reserved clusters instead of allocating new ones.  Whatever the file hasn't grown
+ *   into by the time it is closed is freed again (see tf_fallocate_release()).
+ * RETURN
+ *   0 for NO ERROR, TF_ERR_NO_SPACE if the volume filled up (what was reserved stays reserved)
+ */
+int tf_fallocate(TFFile *fp, uint32_t bytes) {
+    uint32_t want, have, tail, next, start, length, i;
+    TFExtent *last;
+
+    want = (bytes + tf_info.sectorsPerCluster*512 - 1) / (tf_info.sectorsPerCluster*512);
+    dbg_printf("\r\n[DEBUG-tf_fallocate] Reserving %d clusters for %s", want, fp->filename);
+
+    // Clusters the file was waiting to allocate come first, then find the end of the chain,
+    // starting from the end of the extent map
+    if(fp->delayCount) tf_delay_commit(fp);
+    last = &fp->extents[fp->extentCount-1];
+    have = last->index + last->count;
+    tail = last->cluster + last->count - 1;
+    while(have < want) {
+        next = tf_get_fat_entry(tail) & 0x0fffffff;
+        if(next < 2 || next >= TF_MARK_BAD_CLUSTER32) break;
+        tail = next;
+        tf_extent_append(fp, have++, tail);
+    }
+    if(have >= want) return 0;
+    if(tf_free_clusters() < want - have + tf_info.delayedClusters) return TF_ERR_NO_SPACE;
+
+    fp->flags |= TF_FLAG_DIRTY | TF_FLAG_RESERVED;
+    while(have < want) {
+        start = tf_allocate_run(tail, want - have, &length);
+        if(start >= tf_info.totalClusters) return TF_ERR_NO_SPACE;
+        for(i=0; i<length; i++) {
+            tf_extent_append(fp, have + i, start + i);
+        }
+        have += length;
+        tail = start + length - 1;
+    }
+    return 0;
+}
+
+/*
+ * Give back the clusters tf_fallocate() reserved past the end of a file
+ * ARGS
+ *   fp - the file
+ * SIDE EFFECTS
+ *   The chain is cut after the cluster holding the file's last byte (the first cluster always
+ *   stays), the rest is freed with tf_free_clusterchain() and dropped from the extent map.
+ *   The end of the chain is found in the extent map, walking the FAT only past what it maps.
+ * RETURN
+ *   0 for NO ERROR, nonzero if the FAT couldn't be updated
+ */
+int tf_fallocate_release(TFFile *fp) {
+    uint32_t keep, idx, cluster, next;
+    TFExtent *last;
+
+    fp->flags &= ~TF_FLAG_RESERVED;
+    // Clusters waiting to be allocated only ever follow the end of the chain
+    if(fp->delayCount) return 0;
+    keep = (fp->size + tf_info.sectorsPerCluster*512 - 1) / (tf_info.sectorsPerCluster*512);
+    if(keep == 0) keep = 1;
+    last = &fp->extents[fp->extentCount-1];
+    if(keep <= last->index + last->count) cluster = tf_extent_lookup(fp, keep-1);
+    else {
+        cluster = last->cluster + last->count - 1;
+        for(idx = last->index + last->count; idx < keep; idx++) {
+            cluster = tf_get_fat_entry(cluster) & 0x0fffffff;
+            if(cluster < 2 || cluster >= tf_info.totalClusters) return 0;
+        }
+    }
+    next = tf_get_fat_entry(cluster) & 0x0fffffff;
+    if(next < 2 || next >= tf_info.totalClusters) return 0;
+    dbg_printf("\r\n[DEBUG-tf_fallocate_release] %s keeps %d clusters, freeing the rest from %d", fp->filename, keep, next);
+
+    tf_set_fat_entry(cluster, TF_MARK_EOC32);
+    while(fp->extentCount > 1 && fp->extents[fp->extentCount-1].index >= keep) fp->extentCount--;
+    last = &fp->extents[fp->extentCount-1];
+    if(last->index + last->count > keep) last->count = keep - last->index;
+    return tf_free_clusterchain(next);
+}
+
+/*
+ * Tell a placeholder cluster (see tf_delay_cluster()) from a real one
+ * RETURN
+ *   nonzero if cluster is a placeholder
+ */
+int tf_delay_virtual(uint32_t cluster) {
+    return tf_info.delayBase != 0 && cluster - tf_info.delayBase < TF_FILE_HANDLES*TF_DELAY_CLUSTERS;
+}
+
+/*
+ * Tell whether a sector belongs to a placeholder cluster
+ * RETURN
+ *   nonzero if sector is one of the sectors of the placeholder clusters
+ */
+int tf_delay_sector(uint32_t sector) {
+    return tf_info.delayBase != 0 &&
+        sector - tf_first_sector(tf_info.delayBase) < TF_FILE_HANDLES*TF_DELAY_CLUSTERS*tf_info.sectorsPerCluster;
+}
+
+/*
+ * Give a file opened with "d" another cluster at the end, without allocating it yet
+ * ARGS
+ *   fp - the file, positioned on the last cluster of its chain
+ * SIDE EFFECTS
+ *   The file gets a placeholder cluster: a number past the end of the volume, from a range of
+ *   TF_DELAY_CLUSTERS set aside for each file handle.  Its sectors only ever live in tf_info.cache,
+ *   where they are never written back, and nothing on disk links it to the file (see
+ *   tf_extent_lookup()), until tf_delay_commit() allocates real clusters for the lot in as few
+ *   runs as it can.  A file that already has TF_DELAY_CLUSTERS placeholders is committed first,
+ *   and so is one that gets none, so that it can allocate right after its last cluster.
+ * RETURN
+ *   the placeholder, or 0 if the file has to allocate the cluster right away: it wasn't opened
+ *   with "d", the device maps its media, or the clusters already promised would use up the volume
+ */
+uint32_t tf_delay_cluster(TFFile *fp) {
+    int full;
+
+    if(!(fp->mode & TF_MODE_DELAYED) || tf_info.delayBase == 0) return 0;
+    full = tf_free_clusters() <= tf_info.delayedClusters;
+    if(fp->delayCount == TF_DELAY_CLUSTERS || (full && fp->delayCount)) tf_delay_commit(fp);
+    if(full) return 0;
+
+    if(fp->delayCount == 0) {
+        fp->delayIdx = fp->currentClusterIdx + 1;
+        fp->delayTail = fp->currentCluster;
+    }
+    fp->delayCount++;
+    tf_info.delayedClusters++;
+    return tf_info.delayBase + (uint32_t)(fp - tf_file_handles)*TF_DELAY_CLUSTERS + fp->delayCount - 1;
+}
+
+/*
+ * Write the cached sectors of placeholder clusters to the clusters allocated for them
+ * ARGS
+ *   from - the first placeholder sector
+ *   to - the first sector of the real clusters, or 0 to throw the placeholder sectors away
+ *   count - number of sectors
+ * SIDE EFFECTS
+ *   Runs of consecutive cached sectors are written with one vectored request each.  Cached
+ *   copies of the real sectors are updated, and the placeholder entries are emptied.
+ * RETURN
+ *   0 for NO ERROR, nonzero if any of the writes failed
+ */
+int tf_delay_move(uint32_t from, uint32_t to, uint32_t count) {
+    TFIOVec iov[TF_CACHE_FLUSH_IOV];
+    TFCacheEntry *moved[TF_CACHE_FLUSH_IOV];
+    TFCacheEntry *e;
+    uint32_t i, j, iovcnt=0, runStart=0;
+    int rc=0;
+
+    for(i=0; i<=count; i++) {
+        e = NULL;
+        if(i < count) {
+            e = tf_cache_lookup(&tf_info.cache, from + i);
+            if(e->sector != from + i) e = NULL;
+        }
+        // A gap (or a full request) ends the run gathered so far
+        if(iovcnt > 0 && (e == NULL || iovcnt == TF_CACHE_FLUSH_IOV)) {
+            if(to) {
+                dbg_printf("\r\n[DEBUG-tf_delay_move] Writing sectors (%d-%d) to disk.", runStart, runStart + iovcnt - 1);
+                #ifdef TF_DEBUG
+                tf_stats.sector_writes += iovcnt;
+                #endif
+                rc |= write_sectorsv(iov, iovcnt, runStart);
+            }
+            for(j=0; j<iovcnt; j++) {
+                if(moved[j] == tf_info.current) tf_info.currentSector = TF_CACHE_EMPTY;
+                moved[j]->sector = TF_CACHE_EMPTY;
+                moved[j]->flags = 0;
+            }
+            iovcnt = 0;
+        }
+        if(e == NULL) continue;
+        if(iovcnt == 0) runStart = to + i;
+        if(to) tf_cache_update(&tf_info.cache, e->data, to + i, 1);
+        iov[iovcnt].data = e->data;
+        iov[iovcnt].count = 1;
+        moved[iovcnt++] = e;
+    }
+    return rc;
+}
+
+/*
+ * Allocate the clusters a file has been appending to without allocating them
+ * ARGS
+ *   fp - the file
+ * SIDE EFFECTS
+ *   Real clusters replace the file's placeholders (see tf_delay_cluster()): a single run right
+ *   after the end of the chain if there is room, the best fitting ones otherwise (see
+ *   tf_allocate_run()).  The cached placeholder sectors are written to them, and the extent map
+ *   and current cluster of the file are updated.  If the volume fills up, the data that didn't
+ *   fit is dropped and the file is cut short at the end of its clusters.
+ * RETURN
+ *   0 for NO ERROR, TF_ERR_NO_SPACE if the volume filled up, nonzero if writes failed
+ */
+int tf_delay_commit(TFFile *fp) {
+    uint32_t first, end, idx, tail, start, length, i, clusterSize;
+    int rc=0;
+
+    if(fp->delayCount == 0) return 0;
+    first = tf_info.delayBase + (uint32_t)(fp - tf_file_handles)*TF_DELAY_CLUSTERS;
+    end = fp->delayIdx + fp->delayCount;
+    clusterSize = tf_info.sectorsPerCluster*512;
+    dbg_printf("\r\n[DEBUG-tf_delay_commit] Allocating %d delayed clusters of %s", fp->delayCount, fp->filename);
+
+    tail = fp->delayTail;
+    for(idx = fp->delayIdx; idx < end; idx += length) {
+        start = tf_allocate_run(tail, end - idx, &length);
+        if(start >= tf_info.totalClusters) break;
+        rc |= tf_delay_move(tf_first_sector(first + idx - fp->delayIdx), tf_first_sector(start),
+                            length*tf_info.sectorsPerCluster);
+        for(i=0; i<length; i++) {
+            tf_extent_append(fp, idx + i, start + i);
+        }
+        if(fp->currentClusterIdx - idx < length) fp->currentCluster = start + fp->currentClusterIdx - idx;
+        tail = start + length - 1;
+    }
+    tf_info.delayedClusters -= fp->delayCount;
+    fp->delayCount = 0;
+
+    if(idx < end) {
+        dbg_printf("\r\n[DEBUG-tf_delay_commit] Volume full, %s loses %d clusters", fp->filename, end - idx);
+        tf_delay_move(tf_first_sector(first + idx - fp->delayIdx), 0, (end - idx)*tf_info.sectorsPerCluster);
+        if(fp->size > idx*clusterSize) {
+            fp->size = idx*clusterSize;
+            fp->flags |= TF_FLAG_SIZECHANGED;
+        }
+        if(fp->currentClusterIdx >= idx) tf_unsafe_fseek(fp, 0, fp->size - 1);
+        rc = TF_ERR_NO_SPACE;
     }
-    return size - i;
+    return rc;
+}
+
+/*
+ * Allocate the delayed clusters of every open file (see tf_delay_commit())
+ * SIDE EFFECTS
+ *   Cached placeholder sectors that no file owns anymore are dropped, so that they are never
+ *   written back to the (nonexistent) sectors they are named after.
+ * RETURN
+ *   0 for NO ERROR, nonzero if any of the files couldn't be committed
+ */
+int tf_delay_commit_all(void) {
+    TFCacheEntry *e;
+    uint32_t i;
+    int rc=0;
+
+    if(tf_info.delayBase == 0) return 0;
+    for(i=0; i<TF_FILE_HANDLES; i++) {
+        if(tf_file_handles[i].delayCount) rc |= tf_delay_commit(&tf_file_handles[i]);
+    }
+    for(i=0, e=tf_info.cache.entries; i<tf_info.cache.sets*tf_info.cache.ways; i++, e++) {
+        if(e->sector != TF_CACHE_EMPTY && tf_delay_sector(e->sector)) {
+            if(e == tf_info.current) tf_info.currentSector = TF_CACHE_EMPTY;
+            e->sector = TF_CACHE_EMPTY;
+            e->flags = 0;
+        }
+    }
+    return rc;
+}
+
+/*
+ * Make room in tf_info.cache where a sector of a delayed cluster is
+ * ARGS
+ *   entry - the entry holding the sector
+ * SIDE EFFECTS
+ *   The file the cluster belongs to allocates its delayed clusters (see tf_delay_commit()),
+ *   which empties the entry.  A sector no file owns anymore is just dropped.
+ * RETURN
+ *   0 for NO ERROR, nonzero if the file couldn't be committed
+ */
+int tf_delay_evict(TFCacheEntry *entry) {
+    uint32_t handle;
+    int rc=0;
+
+    handle = (entry->sector - tf_first_sector(tf_info.delayBase)) / tf_info.sectorsPerCluster / TF_DELAY_CLUSTERS;
+    if(tf_file_handles[handle].delayCount) rc = tf_delay_commit(&tf_file_handles[handle]);
+    if(entry == tf_info.current) tf_info.currentSector = TF_CACHE_EMPTY;
+    entry->sector = TF_CACHE_EMPTY;
+    entry->flags = 0;
+    return rc;
 }
 
 int tf_fputs(uint8_t *src, TFFile *fp) {
@@ -1308,15 +2786,35 @@ int tf_fputs(uint8_t *src, TFFile *fp) {
 }
 
 int tf_fclose(TFFile *fp) {
-    int rc;
+    int rc=0;
     
     dbg_printf("\r\n[DEBUG-tf_close] Closing file... ");
-    rc =  tf_fflush(fp);
+    // Reserved clusters the file didn't grow into go back to the volume
+    if(fp->flags & TF_FLAG_RESERVED) rc = tf_fallocate_release(fp);
+    rc |= tf_fflush(fp);
     fp->flags &= ~TF_FLAG_OPEN; // Mark the file as available for the system to use
     // FIXME: is there any reason not to release the handle here?
     return rc;
 }
 
+/*
+ * Unmount the filesystem
+ * SIDE EFFECTS
+ *   Every file still open is flushed and closed, then everything cached (including the FSInfo
+ *   free cluster count and hint) is written back with tf_sync().  tf_init() mounts again.
+ * RETURN
+ *   0 for NO ERROR, nonzero if any of the writes failed
+ */
+int tf_unmount(void) {
+    int i, rc=0;
+    dbg_printf("\r\n[DEBUG-tf_unmount] Unmounting... ");
+    for(i=0; i<TF_FILE_HANDLES; i++) {
+        if(tf_file_handles[i].flags & TF_FLAG_OPEN) rc |= tf_fclose(&tf_file_handles[i]);
+    }
+    rc |= tf_sync();
+    return rc;
+}
+
 /* tf_parent attempts to open the parent directory of whatever file you request
 
 returns basically a fp the tf_fnopen returns
@@ -1356,24 +2854,31 @@ TFFile *tf_parent(uint8_t *filename, const uint8_t *mode, int mkParents) {
 int tf_fflush(TFFile *fp) {
     int rc = 0;
     TFFile *dir;
-    FatFileEntry entry;
+    FatFileEntry entry, *e;
     uint8_t *filename=entry.msdos.filename;
 
     if(!(fp->flags & TF_FLAG_DIRTY)) return 0;
 
 
     dbg_printf("\r\n[DEBUG-tf_fflush] Flushing file... ");
-    // First write any pending data to disk
-    if(tf_info.sectorFlags & TF_FLAG_DIRTY) {
-        rc = tf_store();
-    }
-    // Now go modify the directory entry for this file to reflect changes in the file's size
-    // (If they occurred)
+    // The file's own delayed clusters come first, a full volume cuts the size the entry gets
+    if(fp->delayCount) rc = tf_delay_commit(fp);
+    // Bring the directory entry up to date in the cache, to reflect changes in the file's size
+    // (If they occurred), so that a single tf_sync() below writes it along with the data
     if(fp->flags & TF_FLAG_SIZECHANGED) {
 
         if(fp->attributes & 0x10) {
             // TODO Deal with changes in the root directory size here
         }
+        else if(fp->direntSector) {
+            // Where the entry is has been known since the file was opened: update it in place
+            if(tf_fetch(fp->direntSector)) return -1;
+            e = (FatFileEntry *) &tf_info.buffer[fp->direntPos % 512];
+            dbg_printf("\r\n[DEBUG-tf_fflush] Updating file size from %d to %d ", e->msdos.fileSize, fp->size-1);
+            e->msdos.fileSize = fp->size-1;
+            tf_info.current->flags |= TF_FLAG_DIRTY;
+            tf_dentry_update(fp->parentStartCluster, fp->direntPos, e->msdos.fileSize);
+        }
         else {
             // Open the parent directory
             dir = tf_parent(fp->filename, "r+", false);
@@ -1387,19 +2892,25 @@ int tf_fflush(TFFile *fp) {
 
             dbg_printf("\r\n[DEBUG-tf_fflush] Opened %s's parent for directory entry modification... ", fp->filename);
             
-            // Seek to the entry we want to modify and pull it from disk
-            tf_find_file(dir, filename+1);
-            tf_fread((uint8_t*)&entry, sizeof(FatFileEntry), dir);
-            tf_fseek(dir, -sizeof(FatFileEntry), dir->pos);
-            dbg_printf("\r\n[DEBUG-tf_fflush] Updating file size from %d to %d ", entry.msdos.fileSize, fp->size-1);
-            
-            // Modify the entry in place to reflect the new file size
-            entry.msdos.fileSize = fp->size-1; 
-            tf_fwrite((uint8_t*)&entry, sizeof(FatFileEntry), 1, dir); // Write fatfile entry back to disk
+            // Seek to the entry we want to modify and pull it from disk (unless it was removed)
+            if(tf_find_file(dir, filename+1) == 0) {
+                tf_fread((uint8_t*)&entry, sizeof(FatFileEntry), dir);
+                tf_fseek(dir, -(int32_t)sizeof(FatFileEntry), dir->pos);
+                dbg_printf("\r\n[DEBUG-tf_fflush] Updating file size from %d to %d ", entry.msdos.fileSize, fp->size-1);
+                
+                // Modify the entry in place to reflect the new file size
+                entry.msdos.fileSize = fp->size-1; 
+                tf_dentry_update(dir->startCluster, dir->pos, entry.msdos.fileSize);
+                tf_fwrite((uint8_t*)&entry, sizeof(FatFileEntry), 1, dir); // Write fatfile entry back to disk
+            }
+            // The entry goes out with the tf_sync() below, closing the parent needn't sync too
+            dir->flags &= ~TF_FLAG_DIRTY;
             tf_fclose(dir);
         }
         fp->flags &= ~TF_FLAG_SIZECHANGED;
     }
+    // Then write the data, the FAT and the entry to disk
+    rc |= tf_sync();
     
     dbg_printf("\r\n[DEBUG-tf_fflush] Flushed. ");
     fp->flags &= ~TF_FLAG_DIRTY;
@@ -1413,9 +2924,12 @@ int tf_fflush(TFFile *fp) {
  */
 int tf_remove(uint8_t *filename) {
     TFFile *fp;
+    TFDirIndex *index;
     FatFileEntry entry;
+    uint8_t lfn[TF_LFN_ENTRIES*LFN_ENTRY_CAPACITY+1], sfn[13];
     int rc;
-    uint32_t startCluster;
+    uint32_t startCluster, pos, first, record, i;
+    uint8_t sum, deleted = 0xe5;
 
     // Sanity check
     fp = tf_fopen(filename, "r");
@@ -1423,20 +2937,43 @@ int tf_remove(uint8_t *filename) {
     startCluster = fp->startCluster; // Remember first cluster of the file so we can remove the clusterchain
     tf_fclose(fp);
 
-    // TODO Don't leave an orphaned LFN
     fp = tf_parent(filename, "r+", false);
     rc = tf_find_file(fp, (strrchr((uint8_t *)filename, '/')+1));
     if(!rc) {
-        while(1) {
-            rc = tf_fseek(fp, sizeof(FatFileEntry), fp->pos);
-            if(rc) break;
-            tf_fread((uint8_t*)&entry, sizeof(FatFileEntry), fp); // Read one entry ahead
-            tf_fseek(fp, -((int32_t)2*sizeof(FatFileEntry)), fp->pos);
-            tf_fwrite((uint8_t*)&entry, sizeof(FatFileEntry), 1, fp);
-            if(entry.msdos.filename[0] == 0) break;
+        // Find the start of the entry's LFN chain, walking back from its 8.3 record
+        pos = fp->pos;
+        first = pos;
+        tf_fread((uint8_t*)&entry, sizeof(FatFileEntry), fp);
+        sum = tf_lfn_checksum(entry.msdos.filename);
+        while(first >= sizeof(FatFileEntry)) {
+            tf_fseek(fp, 0, first - sizeof(FatFileEntry));
+            tf_fread((uint8_t*)&entry, sizeof(FatFileEntry), fp);
+            if(entry.msdos.attributes != 0x0f || entry.msdos.filename[0] == 0xe5 || entry.lfn.checksum != sum) break;
+            first -= sizeof(FatFileEntry);
+            if(entry.lfn.sequence_number & 0x40) break;
+        }
+        // Take its names out of the index the way they went in
+        if((index = tf_dir_index_get(fp->startCluster)) != NULL) {
+            tf_fseek(fp, 0, first);
+            if(tf_dir_read(fp, &entry, lfn, &record) == 0) {
+                if(lfn[0]) tf_dir_index_remove(index, lfn, strlen((char *)lfn), record);
+                tf_dir_index_remove(index, sfn, tf_sfn_name(sfn, entry.msdos.filename), record);
+            }
+            tf_dir_index_free(index, first / sizeof(FatFileEntry), (pos - first) / sizeof(FatFileEntry) + 1);
+        }
+        // Mark every record of the entry deleted, leaving the entries after it where they are
+        for(i=first; i<=pos; i+=sizeof(FatFileEntry)) {
+            tf_fseek(fp, 0, i);
+            tf_fwrite(&deleted, 1, 1, fp);
+        }
+        // A directory's own entries are gone with its clusters
+        tf_dentry_forget(fp->startCluster, pos);
+        tf_dentry_invalidate(startCluster);
+        tf_dir_index_drop(startCluster);
+        // Files still open on the entry have nowhere to flush their size to
+        for(i=0; i<TF_FILE_HANDLES; i++) {
+            if(tf_file_handles[i].parentStartCluster == fp->startCluster && tf_file_handles[i].direntPos == pos) tf_file_handles[i].direntSector = 0;
         }
-        fp->size-=sizeof(FatFileEntry);
-        fp->flags |= TF_FLAG_SIZECHANGED; 
     }
     tf_fclose(fp);
     tf_free_clusterchain(startCluster); // Free the data associated with the file
@@ -1446,18 +2983,535 @@ int tf_remove(uint8_t *filename) {
 }
 
 
-// Walk the FAT from the very first data sector and find a cluster that's available
-// Return the cluster index 
-// TODO: Rewrite this function so that you can start finding a free cluster at somewhere other than the beginning
+/*
+ * Scan the FAT for a free cluster, reading TF_FAT_SCAN_RUN FAT sectors per device call
+ * ARGS
+ *   start - the first cluster to look at
+ *   end - one past the last cluster to look at
+ * RETURN
+ *   the first free cluster in [start, end), or end if there isn't one
+ */
+uint32_t tf_scan_free_cluster(uint32_t start, uint32_t end) {
+    uint32_t entries[TF_FAT_SCAN_RUN*128];
+    uint32_t sector, count, first, last, i;
+    
+    while(start < end) {
+        sector = start / 128;   // 128 FAT32 entries per 512 byte sector
+        count = (end - 1) / 128 + 1 - sector;
+        if(count > TF_FAT_SCAN_RUN) count = TF_FAT_SCAN_RUN;
+        tf_fetch_run((uint8_t*)entries, tf_info.fatStart + sector, count);
+        first = start - sector*128;
+        last = (end - sector*128 < count*128) ? end - sector*128 : count*128;
+        i = first + tf_fat_find_free(&entries[first], last - first);
+        if(i < last) return sector*128 + i;
+        start = (sector + count) * 128;
+    }
+    return end;
+}
+
+/*
+ * Scan the FAT for a run of free clusters, reading TF_FAT_SCAN_RUN FAT sectors per device call
+ * ARGS
+ *   start - the first cluster to look at
+ *   end - one past the last cluster to look at
+ *   length - the number of consecutive free clusters wanted
+ * RETURN
+ *   the first cluster of the first such run in [start, end), or end if there isn't one
+ */
+uint32_t tf_scan_free_run(uint32_t start, uint32_t end, uint32_t length) {
+    uint32_t entries[TF_FAT_SCAN_RUN*128];
+    uint32_t sector, count, first, last, i, run=0;
+
+    while(start < end) {
+        sector = start / 128;
+        count = (end - 1) / 128 + 1 - sector;
+        if(count > TF_FAT_SCAN_RUN) count = TF_FAT_SCAN_RUN;
+        tf_fetch_run((uint8_t*)entries, tf_info.fatStart + sector, count);
+        first = start - sector*128;
+        last = (end - sector*128 < count*128) ? end - sector*128 : count*128;
+        i = first + tf_fat_find_run(&entries[first], last - first, length, &run);
+        if(i < last) return sector*128 + i + 1 - length;
+        start = (sector + count) * 128;
+    }
+    return end;
+}
+
+/*
+ * Read the FSInfo sector
+ * SIDE EFFECTS
+ *   tf_info.freeCount and tf_info.nextFree are set from the FSInfo sector, where its values are
+ *   plausible (TF_FREE_UNKNOWN and cluster 2 otherwise).  If tf_info.fsinfoSector doesn't hold
+ *   a valid FSInfo structure it is set to 0, and the sector is never written.
+ * RETURN
+ *   0 if a valid FSInfo sector was read, nonzero otherwise
+ */
+int tf_fsinfo_load(void) {
+    FSInfo_struct *fsi;
+
+    tf_info.freeCount = TF_FREE_UNKNOWN;
+    tf_info.nextFree = 2;
+    tf_info.fsinfoDirty = 0;
+    if(tf_info.fsinfoSector == 0 || tf_info.fsinfoSector >= tf_info.reservedSectors || tf_fetch(tf_info.fsinfoSector)) {
+        tf_info.fsinfoSector = 0;
+        return 1;
+    }
+    fsi = (FSInfo_struct *) tf_info.buffer;
+    if(fsi->LeadSig != 0x41615252 || fsi->StrucSig != 0x61417272 || fsi->TrailSig != 0xaa550000) {
+        dbg_printf("\r\n[DEBUG-tf_fsinfo_load] Sector %d is not an FSInfo sector, ignoring it", tf_info.fsinfoSector);
+        tf_info.fsinfoSector = 0;
+        return 1;
+    }
+    if(fsi->FreeCount <= tf_info.totalClusters - 2) tf_info.freeCount = fsi->FreeCount;
+    if(fsi->NextFree >= 2 && fsi->NextFree < tf_info.totalClusters) tf_info.nextFree = fsi->NextFree;
+    dbg_printf("\r\n[DEBUG-tf_fsinfo_load] FSInfo: %d free clusters, next free %d", tf_info.freeCount, tf_info.nextFree);
+    return 0;
+}
+
+/*
+ * Write tf_info.freeCount and tf_info.nextFree back to the FSInfo sector, if they changed
+ * SIDE EFFECTS
+ *   The FSInfo sector is fetched and left dirty in the sector cache
+ * RETURN
+ *   0 for NO ERROR, nonzero if the FSInfo sector couldn't be fetched
+ */
+int tf_fsinfo_store(void) {
+    FSInfo_struct *fsi;
+
+    if(!tf_info.fsinfoDirty || tf_info.fsinfoSector == 0) return 0;
+    if(tf_fetch(tf_info.fsinfoSector)) return 1;
+    fsi = (FSInfo_struct *) tf_info.buffer;
+    fsi->FreeCount = tf_info.freeCount;
+    fsi->NextFree = tf_info.nextFree < tf_info.totalClusters ? tf_info.nextFree : 0xffffffff;
+    tf_info.current->flags |= TF_FLAG_DIRTY;
+    tf_info.fsinfoDirty = 0;
+    return 0;
+}
+
+/*
+ * Return the number of free clusters on the volume
+ * SIDE EFFECTS
+ *   If the count isn't known yet (no valid FSInfo) the free cluster bitmap is built, which
+ *   counts them.  On a volume too big for the bitmap the FAT is read through once instead.
+ */
+uint32_t tf_free_clusters(void) {
+    uint32_t entries[TF_FAT_SCAN_RUN*128];
+    uint32_t sector, count, first, last, free=0;
+
+    if(tf_info.freeCount == TF_FREE_UNKNOWN) tf_freemap_ready();
+    if(tf_info.freeCount != TF_FREE_UNKNOWN) return tf_info.freeCount;
+    for(sector=0; sector*128 < tf_info.totalClusters; sector += count) {
+        count = (tf_info.totalClusters - 1) / 128 + 1 - sector;
+        if(count > TF_FAT_SCAN_RUN) count = TF_FAT_SCAN_RUN;
+        tf_fetch_run((uint8_t*)entries, tf_info.fatStart + sector, count);
+        first = (sector == 0) ? 2 : 0;     // clusters 0 and 1 are reserved
+        last = (tf_info.totalClusters - sector*128 < count*128) ? tf_info.totalClusters - sector*128 : count*128;
+        free += tf_fat_count_free(&entries[first], last - first);
+    }
+    tf_info.freeCount = free;
+    tf_info.fsinfoDirty = 1;
+    return free;
+}
+
+/*
+ * Return the index of the lowest set bit of a nonzero word
+ */
+uint32_t tf_lowest_bit(uint32_t word) {
+#ifdef __GNUC__
+    return __builtin_ctz(word);
+#else
+    uint32_t i=0;
+    while(!(word & 1)) { word >>= 1; i++; }
+    return i;
+#endif
+}
+
+/*
+ * Return the number of set bits in a word
+ */
+uint32_t tf_popcount(uint32_t word) {
+#ifdef __GNUC__
+    return __builtin_popcount(word);
+#else
+    uint32_t n=0;
+    for(; word; word &= word - 1) n++;
+    return n;
+#endif
+}
+
+/*
+ * Find out which of 32 FAT entries are free, a vector of entries at a time where the compiler
+ * targets SSE2 or AVX2 (build with -mavx2 for the latter)
+ * ARGS
+ *   entries - 32 FAT32 entries
+ * RETURN
+ *   a word with bit i set if entries[i] is free (zero, not counting the 4 reserved top bits)
+ */
+uint32_t tf_fat_free_mask(const uint32_t *entries) {
+    uint32_t bits=0;
+    int i;
+#if defined(__AVX2__)
+    const __m256i low = _mm256_set1_epi32(0x0fffffff), zero = _mm256_setzero_si256();
+    __m256i v;
+    for(i=0; i<4; i++) {
+        v = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(entries + i*8)), low);
+        bits |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, zero))) << (i*8);
+    }
+#elif defined(__SSE2__)
+    const __m128i low = _mm_set1_epi32(0x0fffffff), zero = _mm_setzero_si128();
+    __m128i v;
+    for(i=0; i<8; i++) {
+        v = _mm_and_si128(_mm_loadu_si128((const __m128i *)(entries + i*4)), low);
+        bits |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, zero))) << (i*4);
+    }
+#else
+    for(i=0; i<32; i++) {
+        if((entries[i] & 0x0fffffff) == 0) bits |= 1u << i;
+    }
+#endif
+    return bits;
+}
+
+/*
+ * Find the first free entry in an array of FAT entries
+ * ARGS
+ *   entries - the FAT32 entries
+ *   count - number of entries
+ * RETURN
+ *   the index of the first free entry, or count if there isn't one
+ */
+uint32_t tf_fat_find_free(const uint32_t *entries, uint32_t count) {
+    uint32_t i, bits;
+    for(i=0; i+32 <= count; i+=32) {
+        if((bits = tf_fat_free_mask(entries + i)) != 0) return i + tf_lowest_bit(bits);
+    }
+    for(; i<count; i++) {
+        if((entries[i] & 0x0fffffff) == 0) return i;
+    }
+    return count;
+}
+
+/*
+ * Count the free entries in an array of FAT entries
+ * ARGS
+ *   entries - the FAT32 entries
+ *   count - number of entries
+ * RETURN
+ *   the number of free entries
+ */
+uint32_t tf_fat_count_free(const uint32_t *entries, uint32_t count) {
+    uint32_t i, free=0;
+    for(i=0; i+32 <= count; i+=32) {
+        free += tf_popcount(tf_fat_free_mask(entries + i));
+    }
+    for(; i<count; i++) {
+        if((entries[i] & 0x0fffffff) == 0) free++;
+    }
+    return free;
+}
+
+/*
+ * Find the first run of consecutive free entries of a given length in an array of FAT entries
+ * ARGS
+ *   entries - the FAT32 entries
+ *   count - number of entries
+ *   length - the length of run wanted
+ *   run - the length of the free run the entries continue (0 to start afresh), updated to the
+ *         length of the free run they end with, so that a search can go on in the next array
+ * RETURN
+ *   the index of the last entry of the first run long enough (which may have started before
+ *   the array), or count if there isn't one
+ */
+uint32_t tf_fat_find_run(const uint32_t *entries, uint32_t count, uint32_t length, uint32_t *run) {
+    uint32_t i, j, bits;
+    for(i=0; i+32 <= count; i+=32) {
+        bits = tf_fat_free_mask(entries + i);
+        if(bits == 0xffffffff) {
+            // All free: the run goes on through the whole word
+            if(*run + 32 >= length) return i + (length - *run) - 1;
+            *run += 32;
+            continue;
+        }
+        for(j=0; j<32; j++, bits >>= 1) {
+            if(!(bits & 1)) *run = 0;
+            else if(++*run == length) return i + j;
+        }
+    }
+    for(; i<count; i++) {
+        if(entries[i] & 0x0fffffff) *run = 0;
+        else if(++*run == length) return i;
+    }
+    return count;
+}
+
+/*
+ * Record the free clusters of a run of FAT sectors in the free cluster bitmap
+ * ARGS
+ *   entries - the contents of the FAT sectors
+ *   sector - the first sector of the run, relative to the start of the FAT
+ *   count - number of sectors in the run
+ * SIDE EFFECTS
+ *   The words of tf_freemap the run covers that have a free cluster, and their bits of
+ *   tf_freemap_summary, are set.  Words with no free cluster are left alone, so the bitmap has
+ *   to start out all used and the summary all clear.
+ * RETURN
+ *   the number of free clusters in the run
+ */
+uint32_t tf_freemap_fill(const uint32_t *entries, uint32_t sector, uint32_t count) {
+    uint32_t cluster, i, bits, free=0;
+    // A FAT sector covers 4 words of the bitmap
+    for(i=0, cluster=sector*128; i<count*4 && cluster < tf_info.totalClusters; i++, cluster+=32) {
+        bits = tf_fat_free_mask(&entries[i*32]);
+        if(cluster == 0) bits &= ~3u;
+        if(tf_info.totalClusters - cluster < 32) bits &= (1u << (tf_info.totalClusters - cluster)) - 1;
+        if(bits == 0) continue;
+        tf_freemap[cluster / 32] = ~bits;
+        tf_freemap_summary[cluster / 1024] |= 1u << ((cluster / 32) % 32);
+        free += tf_popcount(bits);
+    }
+    return free;
+}
+
+#if TF_MOUNT_THREADS > 0
+/*
+ * Mount thread body: claim TF_MOUNT_SCAN_RUN FAT sectors at a time until the whole FAT is
+ * claimed, reading each run straight from the device and recording it in the bitmap
+ * ARGS
+ *   arg - the thread's TFMountScan
+ * SIDE EFFECTS
+ *   The scan's free is increased by the free clusters found, rc is set if a read failed.
+ *   Runs start on multiples of 8 sectors (1024 clusters), so every word of tf_freemap and of
+ *   tf_freemap_summary is written by a single thread.
+ */
+void *tf_freemap_scan(void *arg) {
+    TFMountScan *scan = (TFMountScan *) arg;
+    uint32_t sectors = (tf_info.totalClusters - 1) / 128 + 1;
+    uint32_t sector, count;
+
+    while((sector = __sync_fetch_and_add(&tf_mount_next, TF_MOUNT_SCAN_RUN)) < sectors) {
+        count = sectors - sector;
+        if(count > TF_MOUNT_SCAN_RUN) count = TF_MOUNT_SCAN_RUN;
+        scan->rc |= tf_info.dev->read(tf_info.dev->ctx, (uint8_t*)scan->entries, tf_info.fatStart + sector, count);
+        // Only read here, nothing changes the cache while the threads run
+        tf_cache_overlay(&tf_info.fatCache, (uint8_t*)scan->entries, tf_info.fatStart + sector, count);
+        scan->free += tf_freemap_fill(scan->entries, sector, count);
+    }
+    return NULL;
+}
+#endif
+
+/*
+ * Build the free cluster bitmap from the FAT
+ * SIDE EFFECTS
+ *   The whole FAT is read into tf_freemap (32 entries a word, see tf_fat_free_mask()) and
+ *   tf_freemap_summary.  Clusters 0 and 1, and the bits past the last cluster, count as used.
+ *   With TF_MOUNT_THREADS, that many threads and the calling one share the FAT between them,
+ *   keeping several reads outstanding on the device; otherwise it is read TF_FAT_SCAN_RUN
+ *   sectors at a time.
+ *   tf_info.freemapReady is set, unless the volume has more than TF_FREEMAP_CLUSTERS clusters,
+ *   in which case free clusters keep being searched for in the FAT itself.
+ *   tf_info.freeCount is set to the number of free clusters found.
+ * RETURN
+ *   0 if the bitmap was built, nonzero otherwise
+ */
+int tf_freemap_build(void) {
+    uint32_t words, free=0;
+#if TF_MOUNT_THREADS > 0
+    pthread_t threads[TF_MOUNT_THREADS];
+    int i, started, rc=0;
+#else
+    uint32_t entries[TF_FAT_SCAN_RUN*128];
+    uint32_t sector, count;
+#endif
+
+    tf_info.freemapReady = 0;
+    tf_info.freemapPending = 0;
+    if(tf_info.totalClusters > TF_FREEMAP_CLUSTERS) {
+        dbg_printf("\r\n[DEBUG-tf_freemap_build] %d clusters don't fit the bitmap, scanning the FAT instead", tf_info.totalClusters);
+        return 1;
+    }
+    dbg_printf("\r\n[DEBUG-tf_freemap_build] Building the free cluster bitmap... ");
+
+    words = (tf_info.totalClusters + 31) / 32;
+    memset(tf_freemap, 0xff, words*4);
+    memset(tf_freemap_summary, 0, ((words + 31) / 32)*4);
+#if TF_MOUNT_THREADS > 0
+    tf_mount_next = 0;
+    for(i=0; i<=TF_MOUNT_THREADS; i++) {
+        tf_mount_scans[i].entries = tf_mount_entries[i];
+        tf_mount_scans[i].free = 0;
+        tf_mount_scans[i].rc = 0;
+    }
+    // Threads that can't be started just leave more of the FAT to the others
+    for(started=0; started<TF_MOUNT_THREADS; started++) {
+        if(pthread_create(&threads[started], NULL, tf_freemap_scan, &tf_mount_scans[started + 1])) break;
+    }
+    dbg_printf("\r\n[DEBUG-tf_freemap_build] Scanning the FAT on %d threads", started + 1);
+    tf_freemap_scan(&tf_mount_scans[0]);
+    for(i=0; i<started; i++) pthread_join(threads[i], NULL);
+    for(i=0; i<=TF_MOUNT_THREADS; i++) {
+        free += tf_mount_scans[i].free;
+        rc |= tf_mount_scans[i].rc;
+    }
+    #ifdef TF_DEBUG
+    tf_stats.sector_reads += (tf_info.totalClusters - 1) / 128 + 1;
+    #endif
+    if(rc) {
+        // Some of the bitmap is missing, better keep searching the FAT itself
+        dbg_printf("\r\n[DEBUG-tf_freemap_build] Reading the FAT failed, scanning the FAT instead");
+        return 1;
+    }
+#else
+    for(sector=0; sector*128 < tf_info.totalClusters; sector += count) {
+        count = (tf_info.totalClusters - 1) / 128 + 1 - sector;
+        if(count > TF_FAT_SCAN_RUN) count = TF_FAT_SCAN_RUN;
+        tf_fetch_run((uint8_t*)entries, tf_info.fatStart + sector, count);
+        free += tf_freemap_fill(entries, sector, count);
+    }
+#endif
+    tf_info.freemapReady = 1;
+    // Having counted them, correct the FSInfo free count if it was off
+    if(tf_info.freeCount != free) {
+        dbg_printf("\r\n[DEBUG-tf_freemap_build] Free cluster count corrected from %d to %d", tf_info.freeCount, free);
+        tf_info.freeCount = free;
+        tf_info.fsinfoDirty = 1;
+    }
+    return 0;
+}
+
+/*
+ * Make sure the free cluster bitmap has been built, if it is ever going to be
+ * SIDE EFFECTS
+ *   The first call after tf_init() builds it (see tf_freemap_build())
+ * RETURN
+ *   nonzero if tf_freemap can be used to find free clusters
+ */
+int tf_freemap_ready(void) {
+    if(tf_info.freemapPending) {
+        tf_info.freemapPending = 0;
+        tf_freemap_build();
+    }
+    return tf_info.freemapReady;
+}
+
+/*
+ * Record a cluster as used or free in the free cluster bitmap
+ * ARGS
+ *   cluster - the cluster that changed
+ *   used - nonzero if it is now in use
+ */
+void tf_freemap_set(uint32_t cluster, int used) {
+    uint32_t w = cluster / 32;
+    if(cluster < 2 || cluster >= tf_info.totalClusters) return;
+    if(used) tf_freemap[w] |= 1u << (cluster % 32);
+    else tf_freemap[w] &= ~(1u << (cluster % 32));
+    if(tf_freemap[w] == 0xffffffff) tf_freemap_summary[w / 32] &= ~(1u << (w % 32));
+    else tf_freemap_summary[w / 32] |= 1u << (w % 32);
+}
+
+/*
+ * Find a free cluster in the free cluster bitmap
+ * ARGS
+ *   start - the first cluster to consider
+ * RETURN
+ *   the first free cluster at or after start, or tf_info.totalClusters if there isn't one
+ */
+uint32_t tf_freemap_find(uint32_t start) {
+    uint32_t w, sw, bits, words;
+
+    if(start >= tf_info.totalClusters) return tf_info.totalClusters;
+    // The rest of start's own word
+    w = start / 32;
+    bits = ~tf_freemap[w] & (0xffffffff << (start % 32));
+    if(bits) return w*32 + tf_lowest_bit(bits);
+
+    // Then the summary tells which of the following words have anything free
+    words = (tf_info.totalClusters + 31) / 32;
+    w++;
+    for(sw = w / 32; sw*32 < words; sw++) {
+        bits = tf_freemap_summary[sw];
+        if(sw == w / 32) bits &= 0xffffffff << (w % 32);
+        if(bits) {
+            w = sw*32 + tf_lowest_bit(bits);
+            return w*32 + tf_lowest_bit(~tf_freemap[w]);
+        }
+    }
+    return tf_info.totalClusters;
+}
+
+/*
+ * Find a cluster in use in the free cluster bitmap
+ * ARGS
+ *   start - the first cluster to consider
+ * RETURN
+ *   the first cluster in use at or after start, or tf_info.totalClusters if there isn't one
+ */
+uint32_t tf_freemap_find_used(uint32_t start) {
+    uint32_t w, bits, words;
+
+    if(start >= tf_info.totalClusters) return tf_info.totalClusters;
+    words = (tf_info.totalClusters + 31) / 32;
+    w = start / 32;
+    bits = tf_freemap[w] & (0xffffffff << (start % 32));
+    while(!bits) {
+        if(++w == words) return tf_info.totalClusters;
+        bits = tf_freemap[w];
+    }
+    w = w*32 + tf_lowest_bit(bits);
+    return w < tf_info.totalClusters ? w : tf_info.totalClusters;
+}
+
+/*
+ * Find the run of free clusters that best fits an allocation, from the free cluster bitmap
+ * ARGS
+ *   count - the number of clusters wanted
+ *   length - set to the length of the run found
+ * RETURN
+ *   the first cluster of the shortest free run of at least count clusters.  If there is no run
+ *   that long, the longest free run.  tf_info.totalClusters if nothing is free.
+ */
+uint32_t tf_freemap_best_fit(uint32_t count, uint32_t *length) {
+    uint32_t start, end, best, bestLength=0, longest, longestLength=0;
+
+    best = longest = tf_info.totalClusters;
+    for(start = tf_freemap_find(2); start < tf_info.totalClusters; start = tf_freemap_find(end)) {
+        end = tf_freemap_find_used(start);
+        if(end - start >= count && (best == tf_info.totalClusters || end - start < bestLength)) {
+            best = start;
+            bestLength = end - start;
+            if(bestLength == count) break;
+        }
+        if(end - start > longestLength) {
+            longest = start;
+            longestLength = end - start;
+        }
+    }
+    if(best != tf_info.totalClusters) {
+        *length = bestLength;
+        return best;
+    }
+    *length = longestLength;
+    return longest;
+}
+
+// Find a cluster that's available, from the free cluster bitmap if there is one, otherwise
+// walking the FAT.  The search starts at the next free hint (see tf_info.nextFree) and wraps
+// around to the very first data cluster.
+// Return the cluster index, or tf_info.totalClusters if the volume is full
 uint32_t tf_find_free_cluster() {
-    uint32_t i, entry, totalClusters;
+    uint32_t i;
     
-    dbg_printf("\r\n[DEBUG-tf_find_free_cluster] Searching for a free cluster... ");
-    totalClusters = tf_info.totalSectors/tf_info.sectorsPerCluster;
-    for(i=0;i<totalClusters; i++) {
-        entry = tf_get_fat_entry(i);
-        if((entry & 0x0fffffff) == 0) break;
-        tf_printf("cluster %x: %x", i, entry);
+    dbg_printf("\r\n[DEBUG-tf_find_free_cluster] Searching for a free cluster from %x... ", tf_info.nextFree);
+    if(tf_info.freeCount == 0) return tf_info.totalClusters;
+    if(tf_freemap_ready()) {
+        i = tf_freemap_find(tf_info.nextFree);
+        if(i == tf_info.totalClusters) i = tf_freemap_find(2);
+    }
+    else {
+        i = tf_scan_free_cluster(tf_info.nextFree, tf_info.totalClusters);
+        if(i == tf_info.totalClusters) {
+            i = tf_scan_free_cluster(2, tf_info.nextFree);
+            if(i == tf_info.nextFree) i = tf_info.totalClusters;
+        }
     }
     dbg_printf("\r\n[DEBUGtf_find_free_cluster] Returning Free cluster number: %d for allocation", i);
     return i;
@@ -1465,16 +3519,12 @@ uint32_t tf_find_free_cluster() {
 
 /* Optimize search for a free cluster */
 uint32_t tf_find_free_cluster_from(uint32_t c) {
-    uint32_t i, entry, totalClusters;
+    uint32_t i;
     dbg_printf("\r\n[DEBUG-tf_find_free_cluster_from] Searching for a free cluster from %x... ", c);
-    totalClusters = tf_info.totalSectors/tf_info.sectorsPerCluster;
-    for(i=c;i<totalClusters; i++) {
-        entry = tf_get_fat_entry(i);
-        if((entry & 0x0fffffff) == 0) break;
-        tf_printf("cluster %x: %x", i, entry);
-    }
+    if(tf_freemap_ready()) i = tf_freemap_find(c);
+    else i = tf_scan_free_cluster(c, tf_info.totalClusters);
     /* We couldn't find anything here so search from the beginning */
-    if (i == totalClusters) {
+    if (i == tf_info.totalClusters) {
         dbg_printf("\r\n[DEBUG-tf_find_free_cluster_from] Couldn't find one from there... starting from beginning");
         return tf_find_free_cluster();
     }
@@ -1483,6 +3533,83 @@ uint32_t tf_find_free_cluster_from(uint32_t c) {
     return i;
 }
 
+/*
+ * Allocate a run of free clusters and hang it off the end of a cluster chain
+ * ARGS
+ *   tail - the last cluster of the chain
+ *   count - the number of clusters wanted
+ *   length - set to the number of clusters allocated, between 1 and count
+ * SIDE EFFECTS
+ *   The run carries on right after tail if all count clusters there are free.  Otherwise it is
+ *   the free run that fits best (see tf_freemap_best_fit()).  Without the free cluster bitmap,
+ *   it is the first run of count free clusters within TF_FREE_RUN_SCAN FAT sectors after tail,
+ *   or failing that the first free cluster after tail.  The run's FAT entries are chained together in
+ *   one ascending pass and terminated before tail is pointed at it.
+ * RETURN
+ *   the first cluster of the run, or tf_info.totalClusters if the volume is full
+ */
+uint32_t tf_allocate_run(uint32_t tail, uint32_t count, uint32_t *length) {
+    uint32_t start, end, i;
+
+    if(!tf_freemap_ready()) {
+        // Look for room for the whole run a little way past tail, one cluster at a time otherwise
+        end = (tf_info.totalClusters - (tail + 1) > TF_FREE_RUN_SCAN*128) ? tail + 1 + TF_FREE_RUN_SCAN*128 : tf_info.totalClusters;
+        start = (count > 1) ? tf_scan_free_run(tail + 1, end, count) : end;
+        *length = count;
+        if(start >= end) {
+            start = tf_find_free_cluster_from(tail);
+            *length = 1;
+        }
+    }
+    else if(tf_freemap_find(tail + 1) == tail + 1 && tf_freemap_find_used(tail + 1) - (tail + 1) >= count) {
+        start = tail + 1;
+        *length = count;
+    }
+    else start = tf_freemap_best_fit(count, length);
+    if(start >= tf_info.totalClusters) return tf_info.totalClusters;
+    if(*length > count) *length = count;
+    dbg_printf("\r\n[DEBUG-tf_allocate_run] Allocating clusters %d-%d after %d", start, start + *length - 1, tail);
+
+    for(i=0; i<*length; i++) {
+        tf_set_fat_entry(start + i, (i + 1 < *length) ? start + i + 1 : TF_MARK_EOC32);
+    }
+    tf_set_fat_entry(tail, start);
+    return start;
+}
+
+/*
+ * Zero a run of sectors on disk.  The run is cut into requests of up to TF_ZERO_RUN sectors,
+ * handed to the device TF_BATCH requests at a time.  Every segment of every request points at
+ * the same zeroed sector, so this costs one sector of memory however long the run is.
+ * RETURN
+ *   0 for no error, nonzero for error with the write
+ */
+int tf_zero_sectors(uint32_t sector, uint32_t count) {
+    uint8_t zero[512];
+    TFIOVec iov[TF_ZERO_RUN];
+    TFBlockRequest batch[TF_BATCH];
+    uint32_t i, n;
+    int rc = 0;
+    
+    memset(zero, 0x00, 0x200);
+    for(i=0; i<TF_ZERO_RUN; i++) {
+        iov[i].data = zero;
+        iov[i].count = 1;
+    }
+    while(count > 0) {
+        for(n=0; n<TF_BATCH && count > 0; n++) {
+            batch[n].iov = iov;
+            batch[n].iovcnt = (count < TF_ZERO_RUN) ? count : TF_ZERO_RUN;
+            batch[n].sector = sector;
+            batch[n].write = 1;
+            sector += batch[n].iovcnt;
+            count -= batch[n].iovcnt;
+        }
+        rc |= transfer_sectors(batch, n);
+    }
+    return rc;
+}
+
 /* Initialize the FileSystem metadata on the media (yes, the "FORMAT" command 
     that Windows doesn't allow for large volumes */
 uint32_t tf_initializeMedia(uint32_t totalSectors)       // this should take in some lun number to make this all good...   but we'll do that when we get read/write_sector lun-aware.
@@ -1565,12 +3692,7 @@ uint32_t tf_initializeMedia(uint32_t totalSectors)       // this should take in
     fat = (bpb.ReservedSectorCount);
 
     dbg_printf("\r\n     clear rest of Cluster");
-    memset(sectorBuf, 0x00, 0x200);
-    for (scl=2 ; scl<bpb.SectorsPerCluster ; scl++)
-    {
-        memset(sectorBuf, 0x00, 0x200);
-        write_sector( sectorBuf, scl );
-    }
+    tf_zero_sectors( 2, bpb.SectorsPerCluster-2 );
         // write backup copy of metadata
     write_sector( sectorBuf0, 6 );
     
@@ -1581,12 +3703,8 @@ uint32_t tf_initializeMedia(uint32_t totalSectors)       // this should take in
     
     // whack ROOT directory file: SSA = RSC + FN x SF + ceil((32 x RDE)/SS)  and LSN = SSA + (CN-2) x SC
     // this clears the first cluster of the root directory
-    memset(sectorBuf, 0x00, 0x200);     // 0x00000000 is the unallocated marker
-    for (scl=ssa+bpb.SectorsPerCluster; scl>=ssa; scl--)
-    {
-        dbg_printf("wiping sector %x  ", scl);
-        write_sector( sectorBuf, scl );
-    }
+    dbg_printf("wiping sectors %x-%x  ", ssa, ssa+bpb.SectorsPerCluster);
+    tf_zero_sectors( ssa, bpb.SectorsPerCluster+1 );
     
     /*// whack a few clusters 1/4th through the partition as well.
     // FIXME: This is a total hack, based on observed behavior.  use determinism
@@ -1601,12 +3719,8 @@ uint32_t tf_initializeMedia(uint32_t totalSectors)       // this should take in
     
     dbg_printf("\r\n    // initialize FAT in Section 1 (first two dwords are special, the rest are 0");
     dbg_printf("\r\n    // write all 00's to all (%d) FAT sectors", ssa-fat);
-    memset(sectorBuf, 0x00, 0x200);     // 0x00000000 is the unallocated marker
-    for (scl=fat; scl<ssa/2; scl++)
-    {
-        write_sector( sectorBuf, scl );
-        write_sector( sectorBuf, scl+(ssa/2) );
-    }
+    tf_zero_sectors( fat, ssa-fat );    // 0x00000000 is the unallocated marker
+    memset(sectorBuf, 0x00, 0x200);
 
     //SSA = RSC + FN x SF + ceil((32 x RDE)/SS)  and LSN = SSA + (CN-2) x SC
     
@@ -1707,12 +3821,7 @@ uint32_t tf_initializeMediaNoBlock(uint32_t totalSectors, int start)
         fat = (bpb.ReservedSectorCount);
 
         dbg_printf("\r\n     clear rest of Cluster");
-        memset(sectorBuf, 0x00, 0x200);
-        for (scl=2 ; scl<sectors_per_cluster ; scl++)
-        {
-            memset(sectorBuf, 0x00, 0x200);
-            write_sector( sectorBuf, scl );
-        }
+        tf_zero_sectors( 2, sectors_per_cluster-2 );
             // write backup copy of metadata
         write_sector( sectorBuf0, 6 );
 
@@ -1723,12 +3832,8 @@ uint32_t tf_initializeMediaNoBlock(uint32_t totalSectors, int start)
 
         // whack ROOT directory file: SSA = RSC + FN x SF + ceil((32 x RDE)/SS)  and LSN = SSA + (CN-2) x SC
         // this clears the first cluster of the root directory
-        memset(sectorBuf, 0x00, 0x200);     // 0x00000000 is the unallocated marker
-        for (scl=ssa+bpb.SectorsPerCluster; scl>=ssa; scl--)
-        {
-            dbg_printf("wiping sector %x  ", scl);
-            write_sector( sectorBuf, scl );
-        }
+        dbg_printf("wiping sectors %x-%x  ", ssa, ssa+bpb.SectorsPerCluster);
+        tf_zero_sectors( ssa, bpb.SectorsPerCluster+1 );
 
         /*// whack a few clusters 1/4th through the partition as well.
         // FIXME: This is a total hack, based on observed behavior.  use determinism
@@ -1745,17 +3850,14 @@ uint32_t tf_initializeMediaNoBlock(uint32_t totalSectors, int start)
     }
     else
     {
-        uint32_t stop = scl+100;
-        if( stop >= (ssa/2) ) stop = ssa/2;
-        memset(sectorBuf, 0x00, 0x200);     // 0x00000000 is the unallocated marker
+        uint32_t stop = scl+200;
+        if( stop >= ssa ) stop = ssa;
         dbg_printf("~", scl, stop);
-        for (; scl<stop; scl++)
-        {
-            write_sector( sectorBuf, scl );
-            write_sector( sectorBuf, scl+(ssa/2) );
-        }
-        if( scl < ssa/2 )
+        tf_zero_sectors( scl, stop-scl );   // 0x00000000 is the unallocated marker
+        scl = stop;
+        if( scl < ssa )
             return false; 
+        memset(sectorBuf, 0x00, 0x200);
 
         //SSA = RSC + FN x SF + ceil((32 x RDE)/SS)  and LSN = SSA + (CN-2) x SC
         